@@ -131,7 +131,7 @@ void CopyLoadSegments(Elf64_Ehdr *ehdr)
     }
 }
 
-EFI_STATUS ReadFile(EFI_FILE_PROTOCOL *file, VOID **buffer)
+EFI_STATUS ReadFile(EFI_FILE_PROTOCOL *file, VOID **buffer, UINTN *read_bytes)
 {
     EFI_STATUS status;
 
@@ -154,7 +154,9 @@ EFI_STATUS ReadFile(EFI_FILE_PROTOCOL *file, VOID **buffer)
         return status;
     }
 
-    return file->Read(file, &file_size, *buffer);
+    status = file->Read(file, &file_size, *buffer);
+    *read_bytes = file_size;
+    return status;
 }
 
 EFI_STATUS OpenBlockIoProtocolForLoadedImage(
@@ -327,7 +329,8 @@ EFI_STATUS EFIAPI UefiMain(
     }
 
     VOID *kernel_buffer;
-    status = ReadFile(kernel_file, &kernel_buffer);
+    UINTN kernel_bytes;
+    status = ReadFile(kernel_file, &kernel_buffer, &kernel_bytes);
 
     if (EFI_ERROR(status))
     {
@@ -359,6 +362,7 @@ EFI_STATUS EFIAPI UefiMain(
     }
 
     VOID *volume_image;
+    UINTN volume_bytes;
 
     EFI_FILE_PROTOCOL *volume_file;
     status = root_dir->Open(
@@ -366,7 +370,7 @@ EFI_STATUS EFIAPI UefiMain(
         EFI_FILE_MODE_READ, 0);
     if (status == EFI_SUCCESS)
     {
-        status = ReadFile(volume_file, &volume_image);
+        status = ReadFile(volume_file, &volume_image, &volume_bytes);
         if (EFI_ERROR(status))
         {
             Print(L"failed to read volume file: %r", status);
@@ -384,7 +388,7 @@ EFI_STATUS EFIAPI UefiMain(
         }
 
         EFI_BLOCK_IO_MEDIA *media = block_io->Media;
-        UINTN volume_bytes = (UINTN)media->BlockSize * (media->LastBlock + 1);
+        volume_bytes = (UINTN)media->BlockSize * (media->LastBlock + 1);
         if (volume_bytes > 32 * 1024 * 1024)
         {
             volume_bytes = 32 * 1024 * 1024;
@@ -456,9 +460,10 @@ EFI_STATUS EFIAPI UefiMain(
     typedef void __attribute((sysv_abi)) EntryPointType(const struct FrameBufferConfig *,
                                                         const struct MemoryMap *,
                                                         const VOID *,
-                                                        VOID *);
+                                                        VOID *,
+                                                        UINTN);
     EntryPointType *entry_point = (EntryPointType *)entry_addr;
-    entry_point(&config, &memmap, acpi_table, volume_image);
+    entry_point(&config, &memmap, acpi_table, volume_image, volume_bytes);
 
     Print(L"All done\n");
 
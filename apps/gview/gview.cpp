@@ -91,8 +91,9 @@ extern "C" void main(int argc, char **argv)
 
     const char *last_slash = strrchr(filepath, '/');
     const char *filename = last_slash ? &last_slash[1] : filepath;
-    SyscallResult window =
-        SyscallOpenWindow(8 + width, 28 + height, 10, 10, filename);
+    WindowSurface surface;
+    SyscallResult window = SyscallOpenWindowSurface(
+        8 + width, 28 + height, 10, 10, filename, &surface);
     if (window.error)
     {
         fprintf(stderr, "%s\n", strerror(window.error));
@@ -102,15 +103,19 @@ extern "C" void main(int argc, char **argv)
 
     for (int y = 0; y < height; ++y)
     {
+        uint32_t *row = &surface.pixels[(24 + y) * surface.pixels_per_scan_line + 4];
         for (int x = 0; x < width; ++x)
         {
             uint32_t c = get_color(&image_data[bytes_per_pixel * (y * width + x)]);
-            SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW,
-                                    4 + x, 24 + y, 1, 1, c);
+            if (surface.format == WindowSurface::kRGB)
+            {
+                c = (c & 0xff) << 16 | (c & 0xff00) | (c >> 16);
+            }
+            row[x] = c;
         }
     }
 
-    SyscallWinRedraw(layer_id);
+    SyscallWinRedrawArea(layer_id, 4, 24, width, height);
     WaitEvent();
 
     SyscallCloseWindow(layer_id);
@@ -25,13 +25,26 @@ extern "C" void main(int argc, char **argv)
 
     std::default_random_engine rand_engine;
     std::uniform_int_distribution x_dist(0, kWidth - 2), y_dist(0, kHeight - 2);
+
+    // Submit the stars in batches to save a syscall per star
+    static constexpr int kBatchSize = 64;
+    DrawCommand commands[kBatchSize];
+    int num_commands = 0;
     for (int i = 0; i < num_stars; ++i)
     {
         int x = x_dist(rand_engine);
         int y = y_dist(rand_engine);
-        SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW,
-                                4 + x, 24 + y, 2, 2, 0xff'f1'00);
+        auto &cmd = commands[num_commands++];
+        cmd.type = DrawCommand::kFillRectangle;
+        cmd.color = 0xff'f1'00;
+        cmd.arg.rect = {4 + x, 24 + y, 2, 2};
+        if (num_commands == kBatchSize)
+        {
+            SyscallWinDrawCommands(layer_id | LAYER_NO_REDRAW, commands, num_commands);
+            num_commands = 0;
+        }
     }
+    SyscallWinDrawCommands(layer_id | LAYER_NO_REDRAW, commands, num_commands);
     SyscallWinRedraw(layer_id);
 
     auto tick_end = SyscallGetCurrentTick();
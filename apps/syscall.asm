@@ -25,4 +25,9 @@ define_syscall CreateTimer, 0x8000000b
 define_syscall OpenFile, 0x8000000c
 define_syscall ReadFile, 0x8000000d
 define_syscall DemandPages, 0x8000000e
-define_syscall MapFile, 0x8000000f
\ No newline at end of file
+define_syscall MapFile, 0x8000000f
+define_syscall SetTimer, 0x80000010
+define_syscall CancelTimer, 0x80000011
+define_syscall WinDrawCommands, 0x80000012
+define_syscall OpenWindowSurface, 0x80000013
+define_syscall WinRedrawArea, 0x80000014
\ No newline at end of file
@@ -11,6 +11,8 @@ extern "C"
 
 #include "../kernel/logger.hpp"
 #include "../kernel/app_event.hpp"
+#include "../kernel/draw_command.hpp"
+#include "../kernel/window_surface.hpp"
     struct SyscallResult
     {
         uint64_t value;
@@ -28,6 +30,10 @@ extern "C"
         uint64_t layer_id_flags, int x, int y, int w, int h, uint32_t color);
     struct SyscallResult SyscallGetCurrentTick();
     struct SyscallResult SyscallWinRedraw(uint64_t layer_id_flags);
+    /* Flags of SyscallWinDrawLine, combined with LAYER_NO_REDRAW and the layer ID.
+     * LINE_ANTIALIAS has no effect on lines wider than 1 pixel. */
+#define LINE_ANTIALIAS (0x0000'0002ull << 32)
+#define LINE_WIDTH(w) ((uint64_t)((w) & 0xff) << 40)
     struct SyscallResult SyscallWinDrawLine(
         uint64_t layer_id_flags, int x0, int y0, int x1, int y1, uint32_t color);
     struct SyscallResult SyscallCloseWindow(uint64_t layer_id_flags);
@@ -43,6 +49,23 @@ extern "C"
     struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
     struct SyscallResult SyscallMapFile(int fd, size_t *file_size, int flags);
 
+    /* Create a timer if timer_id is 0, otherwise rearm the pending timer of the ID.
+     * The value is the ID of the timer, which is valid until it expires or is cancelled. */
+    struct SyscallResult SyscallSetTimer(
+        uint64_t timer_id, unsigned int type, int timer_value, uint64_t timeout_ns);
+    struct SyscallResult SyscallCancelTimer(uint64_t timer_id);
+
+    /* Execute drawing commands against the window, then redraw the drawn area once.
+     * The value is the number of executed commands. */
+    struct SyscallResult SyscallWinDrawCommands(
+        uint64_t layer_id_flags, const struct DrawCommand *commands, size_t len);
+
+    /* Open a window whose pixels are mapped into the application and described by surface.
+     * Write the pixels directly, then call SyscallWinRedrawArea to show the written area. */
+    struct SyscallResult SyscallOpenWindowSurface(
+        int w, int h, int x, int y, const char *title, struct WindowSurface *surface);
+    struct SyscallResult SyscallWinRedrawArea(uint64_t layer_id_flags, int x, int y, int w, int h);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
\ No newline at end of file
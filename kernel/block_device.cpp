@@ -0,0 +1,256 @@
+#include "block_device.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+#include "interrupt.hpp"
+#include "logger.hpp"
+
+RamDisk::RamDisk(void *image, size_t bytes)
+    : image_{reinterpret_cast<uint8_t *>(image)}, num_blocks_{bytes / kBlockSize}
+{
+}
+
+Error RamDisk::Read(uint64_t lba, void *buf, size_t num_blocks)
+{
+    if (lba > num_blocks_ || num_blocks > num_blocks_ - lba)
+    {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    memcpy(buf, &image_[lba * kBlockSize], num_blocks * kBlockSize);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error RamDisk::Write(uint64_t lba, const void *buf, size_t num_blocks)
+{
+    if (lba > num_blocks_ || num_blocks > num_blocks_ - lba)
+    {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    memcpy(&image_[lba * kBlockSize], buf, num_blocks * kBlockSize);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+BlockCache::BlockCache(BlockDevice &device, uint64_t first_lba, size_t blocks_per_entry,
+                       size_t budget_bytes)
+    : device_{device}, first_lba_{first_lba}, blocks_per_entry_{blocks_per_entry},
+      entry_bytes_{blocks_per_entry * device.BlockSize()}, budget_bytes_{budget_bytes}
+{
+}
+
+uint64_t BlockCache::NumEntries() const
+{
+    if (device_.NumBlocks() < first_lba_)
+    {
+        return 0;
+    }
+    return (device_.NumBlocks() - first_lba_) / blocks_per_entry_;
+}
+
+Error BlockCache::Read(uint64_t index, size_t offset, void *buf, size_t len)
+{
+    const auto rflags = DisableInterrupts();
+    auto [entry, err] = Lookup(index);
+    if (!err)
+    {
+        memcpy(buf, &entry->data[offset], len);
+    }
+    RestoreInterrupts(rflags);
+    return err;
+}
+
+Error BlockCache::Write(uint64_t index, size_t offset, const void *buf, size_t len)
+{
+    const auto rflags = DisableInterrupts();
+    auto [entry, err] = Lookup(index);
+    if (!err)
+    {
+        memcpy(&entry->data[offset], buf, len);
+        entry->dirty = true;
+    }
+    RestoreInterrupts(rflags);
+    return err;
+}
+
+WithError<uint8_t *> BlockCache::Pin(uint64_t index)
+{
+    const auto rflags = DisableInterrupts();
+    auto [entry, err] = Lookup(index);
+    uint8_t *data = nullptr;
+    if (!err)
+    {
+        entry->pinned = true;
+        data = entry->data.get();
+        pinned_[data] = index;
+    }
+    RestoreInterrupts(rflags);
+    return {data, err};
+}
+
+void BlockCache::MarkDirty(const void *p)
+{
+    auto p8 = reinterpret_cast<const uint8_t *>(p);
+    const auto rflags = DisableInterrupts();
+    auto it = pinned_.upper_bound(p8);
+    if (it != pinned_.begin())
+    {
+        --it;
+        if (p8 < it->first + entry_bytes_)
+        {
+            map_[it->second]->dirty = true;
+        }
+    }
+    RestoreInterrupts(rflags);
+}
+
+Error BlockCache::Sync()
+{
+    auto rflags = DisableInterrupts();
+    std::vector<uint64_t> indices;
+    for (auto &entry : entries_)
+    {
+        if (entry.dirty && !entry.syncing)
+        {
+            indices.push_back(entry.index);
+        }
+    }
+    RestoreInterrupts(rflags);
+
+    std::unique_ptr<uint8_t[]> copy{new uint8_t[entry_bytes_]};
+    Error result = MAKE_ERROR(Error::kSuccess);
+    for (uint64_t index : indices)
+    {
+        // Writes to the entry during the device write make it dirty again for the next Sync()
+        rflags = DisableInterrupts();
+        auto it = map_.find(index);
+        if (it == map_.end() || !it->second->dirty || it->second->syncing)
+        {
+            RestoreInterrupts(rflags);
+            continue;
+        }
+        Entry &entry = *it->second;
+        memcpy(copy.get(), entry.data.get(), entry_bytes_);
+        entry.dirty = false;
+        entry.syncing = true;
+        RestoreInterrupts(rflags);
+
+        auto err = device_.Write(first_lba_ + index * blocks_per_entry_, copy.get(), blocks_per_entry_);
+
+        rflags = DisableInterrupts();
+        entry.syncing = false;
+        if (err)
+        {
+            entry.dirty = true;
+            result = err;
+        }
+        else
+        {
+            ++write_backs_;
+        }
+        RestoreInterrupts(rflags);
+    }
+    return result;
+}
+
+BlockCacheStat BlockCache::Stat() const
+{
+    const auto rflags = DisableInterrupts();
+    const BlockCacheStat stat{hits_, misses_, read_aheads_, write_backs_,
+                              entries_.size(), entries_.size() * entry_bytes_, budget_bytes_};
+    RestoreInterrupts(rflags);
+    return stat;
+}
+
+WithError<BlockCache::Entry *> BlockCache::Lookup(uint64_t index)
+{
+    if (auto it = map_.find(index); it != map_.end())
+    {
+        ++hits_;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return {&entries_.front(), MAKE_ERROR(Error::kSuccess)};
+    }
+
+    ++misses_;
+    if (auto err = Load(index, true))
+    {
+        return {nullptr, err};
+    }
+
+    // Sequential reads find the next entries already in the cache
+    if (index == last_miss_ + 1)
+    {
+        const uint64_t end = std::min(index + 1 + kReadAheadEntries, NumEntries());
+        for (uint64_t i = index + 1; i < end; ++i)
+        {
+            if (map_.count(i) == 0 && !Load(i, false))
+            {
+                ++read_aheads_;
+            }
+        }
+    }
+    last_miss_ = index;
+
+    Evict();
+    return {&entries_.front(), MAKE_ERROR(Error::kSuccess)};
+}
+
+Error BlockCache::Load(uint64_t index, bool front)
+{
+    if (index >= NumEntries())
+    {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    std::unique_ptr<uint8_t[]> data{new uint8_t[entry_bytes_]};
+    if (auto err = device_.Read(first_lba_ + index * blocks_per_entry_,
+                                data.get(), blocks_per_entry_))
+    {
+        return err;
+    }
+
+    // Entries read ahead go behind the front one, which the caller is about to use
+    auto pos = front || entries_.empty() ? entries_.begin() : std::next(entries_.begin());
+    auto it = entries_.insert(pos, Entry{index, false, false, false, std::move(data)});
+    map_[index] = it;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error BlockCache::WriteBack(Entry &entry)
+{
+    if (auto err = device_.Write(first_lba_ + entry.index * blocks_per_entry_,
+                                 entry.data.get(), blocks_per_entry_))
+    {
+        return err;
+    }
+    entry.dirty = false;
+    ++write_backs_;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void BlockCache::Evict()
+{
+    size_t used_bytes = entries_.size() * entry_bytes_;
+    auto it = entries_.end();
+    while (used_bytes > budget_bytes_ && it != std::next(entries_.begin()))
+    {
+        --it;
+        if (it->pinned || it->syncing)
+        {
+            continue;
+        }
+        if (it->dirty)
+        {
+            if (auto err = WriteBack(*it))
+            {
+                Log(kError, "failed to write back block %lu: %s\n",
+                    first_lba_ + it->index * blocks_per_entry_, err.Name());
+                continue;
+            }
+        }
+        map_.erase(it->index);
+        it = entries_.erase(it);
+        used_bytes -= entry_bytes_;
+    }
+}
@@ -0,0 +1,135 @@
+/**
+ * @file block_device.hpp
+ *
+ * @brief Devices addressed by fixed-size blocks, and the buffer cache in front of them.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#include "error.hpp"
+
+class BlockDevice
+{
+public:
+    virtual ~BlockDevice() = default;
+    /** @brief Read num_blocks blocks from the block lba into buf */
+    virtual Error Read(uint64_t lba, void *buf, size_t num_blocks) = 0;
+    /** @brief Write num_blocks blocks from buf to the block lba */
+    virtual Error Write(uint64_t lba, const void *buf, size_t num_blocks) = 0;
+    virtual size_t BlockSize() const = 0;
+    virtual uint64_t NumBlocks() const = 0;
+};
+
+/**
+ * @brief Block device backed by a volume image in memory
+ *
+ * The loader copies the boot volume into memory, and this device serves it.
+ * Writes go to the image, so they last until the machine is reset.
+ */
+class RamDisk : public BlockDevice
+{
+public:
+    static const size_t kBlockSize = 512;
+
+    RamDisk(void *image, size_t bytes);
+    Error Read(uint64_t lba, void *buf, size_t num_blocks) override;
+    Error Write(uint64_t lba, const void *buf, size_t num_blocks) override;
+    size_t BlockSize() const override { return kBlockSize; }
+    uint64_t NumBlocks() const override { return num_blocks_; }
+
+private:
+    uint8_t *image_;
+    uint64_t num_blocks_;
+};
+
+struct BlockCacheStat
+{
+    size_t hits;
+    size_t misses;
+    size_t read_aheads;
+    size_t write_backs;
+    size_t num_entries;
+    size_t used_bytes;
+    size_t budget_bytes;
+};
+
+/**
+ * @brief Write-back LRU cache of a BlockDevice
+ *
+ * The cache holds entries of blocks_per_entry blocks each,
+ * and the entry of an index starts from the block first_lba + index * blocks_per_entry.
+ * Entries are listed in the order of use, and the hash map finds the list node of an index.
+ * Written entries go back to the device when they are evicted or by Sync().
+ * A miss on the entry next to the previous miss reads the following kReadAheadEntries entries as well.
+ *
+ * Pin() keeps an entry in memory for good and returns its buffer,
+ * so the caller may hold pointers into it and write through them.
+ * Writes through the buffer are written back only after MarkDirty() tells about them.
+ *
+ * The methods disable interrupts while they touch the cache, so tasks can share it.
+ * Sync() writes to the device with interrupts enabled, from a copy of each entry.
+ */
+class BlockCache
+{
+public:
+    static const size_t kReadAheadEntries = 4;
+
+    BlockCache(BlockDevice &device, uint64_t first_lba, size_t blocks_per_entry,
+               size_t budget_bytes);
+
+    size_t EntryBytes() const { return entry_bytes_; }
+    /** @brief The number of entries which fit in the device */
+    uint64_t NumEntries() const;
+
+    /** @brief Copy len bytes from offset in the entry, which must not go beyond the entry */
+    Error Read(uint64_t index, size_t offset, void *buf, size_t len);
+    /** @brief Copy len bytes to offset in the entry, which must not go beyond the entry */
+    Error Write(uint64_t index, size_t offset, const void *buf, size_t len);
+    /** @brief Keep the entry in the cache and return its buffer */
+    WithError<uint8_t *> Pin(uint64_t index);
+    /** @brief Mark the pinned entry which holds the address as written */
+    void MarkDirty(const void *p);
+    /** @brief Write all written entries back to the device */
+    Error Sync();
+
+    BlockCacheStat Stat() const;
+
+private:
+    struct Entry
+    {
+        uint64_t index;
+        bool dirty;
+        bool pinned;
+        /** @brief Sync() is writing a copy of the entry, so it must stay in the cache */
+        bool syncing;
+        std::unique_ptr<uint8_t[]> data;
+    };
+
+    BlockDevice &device_;
+    uint64_t first_lba_;
+    size_t blocks_per_entry_;
+    size_t entry_bytes_;
+    size_t budget_bytes_;
+
+    std::list<Entry> entries_{};
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> map_{};
+    /** @brief The index of each pinned entry by the address of its buffer */
+    std::map<const uint8_t *, uint64_t> pinned_{};
+    uint64_t last_miss_{~uint64_t{0}};
+    size_t hits_{0}, misses_{0}, read_aheads_{0}, write_backs_{0};
+
+    /** @brief Move the entry to the front of the list, reading it on a miss */
+    WithError<Entry *> Lookup(uint64_t index);
+    /** @brief Read the entry from the device and put it after the front entry */
+    Error Load(uint64_t index, bool front);
+    Error WriteBack(Entry &entry);
+    /** @brief Drop least recently used entries over the budget, but keep the front one and pinned ones */
+    void Evict();
+};
@@ -25,7 +25,7 @@ void Console::PutString(const char *s)
         }
         else if (cursor_column_ < kColumns - 1)
         {
-            WriteAscii(*writer_, Vector2D<int>{8 * cursor_column_, 16 * cursor_row_}, *s, fg_color_);
+            WriteAscii(*writer_, Vector2D<int>{8 * cursor_column_, 16 * cursor_row_}, *s, fg_color_, bg_color_);
             buffer_[cursor_row_][cursor_column_] = *s;
             ++cursor_column_;
         }
@@ -90,7 +90,7 @@ void Console::NewLine()
         for (int row = 0; row < kRows - 1; ++row)
         {
             memcpy(buffer_[row], buffer_[row + 1], kColumns + 1);
-            WriteString(*writer_, Vector2D<int>{0, 16 * row}, buffer_[row], fg_color_);
+            WriteString(*writer_, Vector2D<int>{0, 16 * row}, buffer_[row], fg_color_, bg_color_);
         }
         memset(buffer_[kRows - 1], 0, kColumns + 1);
     }
@@ -101,7 +101,7 @@ void Console::Refresh()
     FillRectangle(*writer_, {0, 0}, {8 * kColumns, 16 * kRows}, bg_color_);
     for (int row = 0; row < kRows; ++row)
     {
-        WriteString(*writer_, Vector2D<int>{0, 16 * row}, buffer_[row], fg_color_);
+        WriteString(*writer_, Vector2D<int>{0, 16 * row}, buffer_[row], fg_color_, bg_color_);
     }
 }
 
@@ -0,0 +1,41 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /** @brief A drawing operation submitted in a batch by SyscallWinDrawCommands */
+    struct DrawCommand
+    {
+        enum Type
+        {
+            kFillRectangle,
+            kDrawLine,
+            kWriteString,
+        } type;
+
+        uint32_t color;
+
+        union
+        {
+            struct
+            {
+                int x, y, w, h;
+            } rect;
+
+            struct
+            {
+                int x0, y0, x1, y1;
+            } line;
+
+            struct
+            {
+                int x, y;
+                const char *s;
+            } string;
+        } arg;
+    };
+#ifdef __cplusplus
+} // extern "C"
+#endif
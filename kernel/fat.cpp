@@ -4,6 +4,8 @@
 #include <cstring>
 #include <cctype>
 #include <utility>
+#include "block_device.hpp"
+#include "interrupt.hpp"
 #include "logger.hpp"
 
 namespace
@@ -25,27 +27,380 @@ namespace
     }
 } // namespace
 
+namespace
+{
+    /** @brief Cache of sectors from the top of the volume, which holds the reserved sectors and FAT */
+    BlockCache *sector_cache;
+    /** @brief Cache of clusters, whose entry i is the cluster i + 2 */
+    BlockCache *volume_cache;
+    /** @brief The number of clusters and 2, that is, the end of valid cluster numbers */
+    unsigned long cluster_end;
+    /** @brief The device holds only the head of the volume, so cluster_end is less than the volume's */
+    bool volume_truncated;
+
+    /** @brief The entry of sector_cache and the offset in it of a byte address of the volume */
+    std::pair<uint64_t, size_t> LocateSector(uint64_t addr)
+    {
+        const auto bytes_per_sector = fat::boot_volume_bpb.bytes_per_sector;
+        return {addr / bytes_per_sector, addr % bytes_per_sector};
+    }
+
+    uint64_t FATEntryAddr(unsigned long cluster, int fat_index)
+    {
+        const auto &bpb = fat::boot_volume_bpb;
+        return (bpb.reserved_sector_count +
+                static_cast<uint64_t>(fat_index) * bpb.fat_size_32) *
+                   bpb.bytes_per_sector +
+               cluster * sizeof(uint32_t);
+    }
+
+    uint32_t ReadFAT(unsigned long cluster)
+    {
+        auto [index, offset] = LocateSector(FATEntryAddr(cluster, 0));
+        uint32_t value;
+        if (auto err = sector_cache->Read(index, offset, &value, sizeof(value)))
+        {
+            Log(kError, "failed to read FAT entry %lu: %s\n", cluster, err.Name());
+            return fat::kEndOfClusterchain;
+        }
+        return value & 0x0ffffffflu;
+    }
+
+    /** @brief Update the entry in every copy of FAT */
+    void WriteFAT(unsigned long cluster, uint32_t value)
+    {
+        for (int i = 0; i < fat::boot_volume_bpb.num_fats; ++i)
+        {
+            auto [index, offset] = LocateSector(FATEntryAddr(cluster, i));
+            if (auto err = sector_cache->Write(index, offset, &value, sizeof(value)))
+            {
+                Log(kError, "failed to write FAT entry %lu: %s\n", cluster, err.Name());
+            }
+        }
+    }
+
+    size_t ReadCluster(unsigned long cluster, size_t offset, void *buf, size_t len)
+    {
+        if (auto err = volume_cache->Read(cluster - 2, offset, buf, len))
+        {
+            Log(kError, "failed to read cluster %lu: %s\n", cluster, err.Name());
+            return 0;
+        }
+        return len;
+    }
+
+    size_t WriteCluster(unsigned long cluster, size_t offset, const void *buf, size_t len)
+    {
+        if (auto err = volume_cache->Write(cluster - 2, offset, buf, len))
+        {
+            Log(kError, "failed to write cluster %lu: %s\n", cluster, err.Name());
+            return 0;
+        }
+        return len;
+    }
+
+    /** @brief Bit i is set if the cluster i is in use, the clusters 0 and 1 are marked as used */
+    std::vector<uint64_t> *cluster_bitmap;
+    unsigned long num_free_clusters;
+    /** @brief The cluster where the search for free clusters starts */
+    unsigned long next_free_hint;
+    /** @brief Byte address of the FSInfo sector, or 0 if the volume has none */
+    uint64_t fs_info_addr;
+
+    bool ClusterInUse(unsigned long cluster)
+    {
+        return (*cluster_bitmap)[cluster / 64] & (uint64_t{1} << (cluster % 64));
+    }
+
+    void MarkClusterInUse(unsigned long cluster)
+    {
+        (*cluster_bitmap)[cluster / 64] |= uint64_t{1} << (cluster % 64);
+    }
+
+    /** @brief Find a free cluster from the cluster, return cluster_end if there is none up to the end */
+    unsigned long FindFreeCluster(unsigned long from)
+    {
+        auto &bitmap = *cluster_bitmap;
+        for (size_t word = from / 64; word < bitmap.size(); ++word)
+        {
+            uint64_t free_bits = ~bitmap[word];
+            if (word == from / 64)
+            {
+                free_bits &= ~uint64_t{0} << (from % 64);
+            }
+            if (free_bits)
+            {
+                return std::min<unsigned long>(word * 64 + __builtin_ctzll(free_bits), cluster_end);
+            }
+        }
+        return cluster_end;
+    }
+
+    /**
+     * @brief Find free clusters to allocate n clusters from, searching from the cluster and wrapping around
+     *
+     * @return The first of the first run of n free clusters, or the longest run if there is no such run
+     */
+    std::pair<unsigned long, size_t> FindFreeRun(unsigned long from, size_t n)
+    {
+        unsigned long best = 0;
+        size_t best_len = 0;
+        unsigned long cluster = from;
+        bool wrapped = false;
+        while (true)
+        {
+            cluster = FindFreeCluster(cluster);
+            if (cluster == cluster_end)
+            {
+                if (wrapped || from == 2)
+                {
+                    break;
+                }
+                wrapped = true;
+                cluster = FindFreeCluster(2);
+                if (cluster == cluster_end)
+                {
+                    break;
+                }
+            }
+            if (wrapped && cluster >= from)
+            {
+                break;
+            }
+
+            size_t len = 1;
+            while (len < n && cluster + len < cluster_end && !ClusterInUse(cluster + len))
+            {
+                ++len;
+            }
+            if (len == n)
+            {
+                return {cluster, len};
+            }
+            if (len > best_len)
+            {
+                best = cluster;
+                best_len = len;
+            }
+            cluster += len;
+        }
+        return {best, best_len};
+    }
+
+    /**
+     * @brief Allocate n clusters and chain them after prev, or make a new chain if prev is 0
+     *
+     * Clusters next to prev are preferred, and then runs of n free clusters from next_free_hint.
+     *
+     * @return The first allocated cluster, or kEndOfClusterchain if no cluster is free
+     */
+    unsigned long AllocateClusters(unsigned long prev, size_t n)
+    {
+        const auto rflags = DisableInterrupts();
+        unsigned long first = fat::kEndOfClusterchain;
+        while (n > 0 && num_free_clusters > 0)
+        {
+            unsigned long from = next_free_hint;
+            if (prev != 0 && prev + 1 < cluster_end && !ClusterInUse(prev + 1))
+            {
+                from = prev + 1;
+            }
+            const auto [start, len] = FindFreeRun(from, n);
+            if (len == 0)
+            {
+                break;
+            }
+
+            for (unsigned long cluster = start; cluster < start + len; ++cluster)
+            {
+                MarkClusterInUse(cluster);
+                if (prev != 0)
+                {
+                    WriteFAT(prev, cluster);
+                }
+                if (first == fat::kEndOfClusterchain)
+                {
+                    first = cluster;
+                }
+                prev = cluster;
+            }
+            n -= len;
+            num_free_clusters -= len;
+            next_free_hint = start + len < cluster_end ? start + len : 2;
+        }
+        if (prev != 0)
+        {
+            WriteFAT(prev, fat::kEndOfClusterchain);
+        }
+        RestoreInterrupts(rflags);
+        return first;
+    }
+
+    /** @brief Mark clusters whose FAT entries are not 0, reading FAT a sector at a time */
+    Error BuildClusterBitmap()
+    {
+        const auto bytes_per_sector = fat::boot_volume_bpb.bytes_per_sector;
+        cluster_bitmap = new std::vector<uint64_t>((cluster_end + 63) / 64);
+        num_free_clusters = 0;
+        std::vector<uint32_t> entries(bytes_per_sector / sizeof(uint32_t));
+
+        unsigned long cluster = 0;
+        while (cluster < cluster_end)
+        {
+            auto [index, offset] = LocateSector(FATEntryAddr(cluster, 0));
+            const size_t n = std::min<size_t>((bytes_per_sector - offset) / sizeof(uint32_t),
+                                              cluster_end - cluster);
+            if (auto err = sector_cache->Read(index, offset, entries.data(), n * sizeof(uint32_t)))
+            {
+                return err;
+            }
+            for (size_t i = 0; i < n; ++i, ++cluster)
+            {
+                if (cluster < 2 || (entries[i] & 0x0ffffffflu) != 0)
+                {
+                    MarkClusterInUse(cluster);
+                }
+                else
+                {
+                    ++num_free_clusters;
+                }
+            }
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+} // namespace
+
 namespace fat
 {
-    BPB *boot_volume_image;
+    BPB boot_volume_bpb;
     unsigned long bytes_per_cluster;
 
-    void Initialize(void *volume_image)
+    Error Initialize(BlockDevice &device)
     {
-        boot_volume_image = reinterpret_cast<fat::BPB *>(volume_image);
+        std::unique_ptr<uint8_t[]> sector{new uint8_t[device.BlockSize()]};
+        if (auto err = device.Read(0, sector.get(), 1))
+        {
+            return err;
+        }
+        memcpy(&boot_volume_bpb, sector.get(), sizeof(boot_volume_bpb));
+
+        const auto &bpb = boot_volume_bpb;
+        if (bpb.bytes_per_sector == 0 || bpb.sectors_per_cluster == 0 ||
+            bpb.bytes_per_sector % device.BlockSize() != 0)
+        {
+            return MAKE_ERROR(Error::kInvalidFormat);
+        }
         bytes_per_cluster =
-            static_cast<unsigned long>(boot_volume_image->bytes_per_sector) *
-            boot_volume_image->sectors_per_cluster;
+            static_cast<unsigned long>(bpb.bytes_per_sector) * bpb.sectors_per_cluster;
+
+        const uint64_t data_start_sector =
+            bpb.reserved_sector_count +
+            static_cast<uint64_t>(bpb.num_fats) * bpb.fat_size_32;
+        cluster_end = (bpb.total_sectors_32 - data_start_sector) / bpb.sectors_per_cluster + 2;
+
+        const size_t blocks_per_sector = bpb.bytes_per_sector / device.BlockSize();
+        sector_cache = new BlockCache{device, 0, blocks_per_sector, kDefaultSectorCacheBytes};
+        volume_cache = new BlockCache{device,
+                                      data_start_sector * blocks_per_sector,
+                                      bpb.sectors_per_cluster * blocks_per_sector,
+                                      kDefaultVolumeCacheBytes};
+
+        // The device may be smaller than the volume, as the loader reads a part of a large volume
+        if (volume_cache->NumEntries() == 0)
+        {
+            return MAKE_ERROR(Error::kInvalidFormat);
+        }
+        volume_truncated = volume_cache->NumEntries() + 2 < cluster_end;
+        if (volume_truncated)
+        {
+            cluster_end = volume_cache->NumEntries() + 2;
+        }
+
+        if (auto err = BuildClusterBitmap())
+        {
+            return err;
+        }
+
+        // FSInfo only gives a hint, the counts come from the bitmap
+        next_free_hint = 2;
+        fs_info_addr = 0;
+        if (bpb.fs_info != 0 && bpb.fs_info != 0xffff)
+        {
+            FSInfo fs_info;
+            auto [index, offset] = LocateSector(static_cast<uint64_t>(bpb.fs_info) * bpb.bytes_per_sector);
+            if (!sector_cache->Read(index, offset, &fs_info, sizeof(fs_info)) &&
+                fs_info.lead_signature == FSInfo::kLeadSignature &&
+                fs_info.struct_signature == FSInfo::kStructSignature)
+            {
+                fs_info_addr = static_cast<uint64_t>(bpb.fs_info) * bpb.bytes_per_sector;
+                if (2 <= fs_info.next_free && fs_info.next_free < cluster_end)
+                {
+                    next_free_hint = fs_info.next_free;
+                }
+            }
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    Error Sync()
+    {
+        if (fs_info_addr != 0)
+        {
+            const auto rflags = DisableInterrupts();
+            // The free clusters beyond the device are not counted, so the count is left unknown
+            const uint32_t counts[2] = {volume_truncated ? FSInfo::kUnknownCount
+                                                         : static_cast<uint32_t>(num_free_clusters),
+                                        static_cast<uint32_t>(next_free_hint)};
+            RestoreInterrupts(rflags);
+
+            auto [index, offset] = LocateSector(fs_info_addr + offsetof(FSInfo, free_count));
+            if (auto err = sector_cache->Write(index, offset, counts, sizeof(counts)))
+            {
+                return err;
+            }
+        }
+        // Clusters go first, so FAT does not refer to clusters which are not written yet
+        auto err = volume_cache->Sync();
+        if (auto sector_err = sector_cache->Sync(); !err)
+        {
+            err = sector_err;
+        }
+        return err;
+    }
+
+    unsigned long NumFreeClusters()
+    {
+        return num_free_clusters;
+    }
+
+    BlockCacheStat VolumeCacheStat()
+    {
+        auto stat = volume_cache->Stat();
+        const auto sector_stat = sector_cache->Stat();
+        stat.hits += sector_stat.hits;
+        stat.misses += sector_stat.misses;
+        stat.read_aheads += sector_stat.read_aheads;
+        stat.write_backs += sector_stat.write_backs;
+        stat.num_entries += sector_stat.num_entries;
+        stat.used_bytes += sector_stat.used_bytes;
+        stat.budget_bytes += sector_stat.budget_bytes;
+        return stat;
     }
 
     uintptr_t GetClusterAddr(unsigned long cluster)
     {
-        unsigned long sector_num =
-            boot_volume_image->reserved_sector_count +
-            boot_volume_image->num_fats * boot_volume_image->fat_size_32 +
-            (cluster - 2) * boot_volume_image->sectors_per_cluster;
-        uintptr_t offset = sector_num * boot_volume_image->bytes_per_sector;
-        return reinterpret_cast<uintptr_t>(boot_volume_image) + offset;
+        auto [data, err] = volume_cache->Pin(cluster - 2);
+        if (err)
+        {
+            Log(kError, "failed to read cluster %lu: %s\n", cluster, err.Name());
+            return 0;
+        }
+        return reinterpret_cast<uintptr_t>(data);
+    }
+
+    void MarkDirty(const void *p)
+    {
+        volume_cache->MarkDirty(p);
     }
 
     void ReadName(const DirectoryEntry &entry, char *base, char *ext)
@@ -77,10 +432,7 @@ namespace fat
 
     unsigned long NextCluster(unsigned long cluster)
     {
-        uintptr_t fat_offset = boot_volume_image->reserved_sector_count * boot_volume_image->bytes_per_sector;
-        uint32_t *fat = reinterpret_cast<uint32_t *>(
-            reinterpret_cast<uintptr_t>(boot_volume_image) + fat_offset);
-        uint32_t next = fat[cluster];
+        uint32_t next = ReadFAT(cluster);
         if (next >= 0x0ffffff8ul)
         {
             return kEndOfClusterchain;
@@ -93,12 +445,12 @@ namespace fat
     {
         if (path[0] == '/')
         {
-            directory_cluster = boot_volume_image->root_cluster;
+            directory_cluster = boot_volume_bpb.root_cluster;
             ++path;
         }
         else if (directory_cluster == 0)
         {
-            directory_cluster = boot_volume_image->root_cluster;
+            directory_cluster = boot_volume_bpb.root_cluster;
         }
 
         char path_elem[13];
@@ -108,6 +460,10 @@ namespace fat
         while (directory_cluster != kEndOfClusterchain)
         {
             auto dir = GetSectorByCluster<DirectoryEntry>(directory_cluster);
+            if (dir == nullptr)
+            {
+                break;
+            }
             for (int i = 0; i < bytes_per_cluster / sizeof(DirectoryEntry); ++i)
             {
                 if (dir[i].name[0] == 0x00)
@@ -170,39 +526,13 @@ namespace fat
         return cluster >= 0x0ffffff8ul;
     }
 
-    uint32_t *GetFAT()
-    {
-        uintptr_t fat_offset =
-            boot_volume_image->reserved_sector_count *
-            boot_volume_image->bytes_per_sector;
-        return reinterpret_cast<uint32_t *>(
-            reinterpret_cast<uintptr_t>(boot_volume_image) + fat_offset);
-    }
-
     unsigned long ExtendCluster(unsigned long eoc_cluster, size_t n)
     {
-        uint32_t *fat = GetFAT();
-        while (!IsEndOfClusterchain(fat[eoc_cluster]))
-        {
-            eoc_cluster = fat[eoc_cluster];
-        }
-
-        size_t num_allocated = 0;
-        auto current = eoc_cluster;
-
-        for (unsigned long candidate = 2; num_allocated < n; ++candidate)
+        while (!IsEndOfClusterchain(ReadFAT(eoc_cluster)))
         {
-
-            if (fat[candidate] != 0) // candidate cluster is not free
-            {
-                continue;
-            }
-            fat[current] = candidate;
-            current = candidate;
-            ++num_allocated;
+            eoc_cluster = ReadFAT(eoc_cluster);
         }
-        fat[current] = kEndOfClusterchain;
-        return current;
+        return AllocateClusters(eoc_cluster, n);
     }
 
     DirectoryEntry *AllocateEntry(unsigned long dir_cluster)
@@ -210,6 +540,10 @@ namespace fat
         while (true)
         {
             auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
+            if (dir == nullptr)
+            {
+                return nullptr;
+            }
             for (int i = 0; i < bytes_per_cluster / sizeof(DirectoryEntry); ++i)
             {
                 if (dir[i].name[0] == 0 || dir[i].name[0] == 0xe5)
@@ -227,7 +561,12 @@ namespace fat
 
         dir_cluster = ExtendCluster(dir_cluster, 1);
         auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
+        if (dir == nullptr)
+        {
+            return nullptr;
+        }
         memset(dir, 0, bytes_per_cluster);
+        MarkDirty(dir);
         return &dir[0];
     }
 
@@ -257,7 +596,7 @@ namespace fat
 
     WithError<DirectoryEntry *> CreateFile(const char *path)
     {
-        auto parent_dir_cluster = fat::boot_volume_image->root_cluster;
+        auto parent_dir_cluster = fat::boot_volume_bpb.root_cluster;
         const char *filename = path;
 
         if (const char *slash_pos = strrchr(path, '/'))
@@ -289,129 +628,171 @@ namespace fat
         }
         fat::SetFileName(*dir, filename);
         dir->file_size = 0;
+        fat::MarkDirty(dir);
         return {dir, MAKE_ERROR(Error::kSuccess)};
     }
 
     unsigned long AllocateClusterChain(size_t n)
     {
-        uint32_t *fat = GetFAT();
-        unsigned long first_cluster;
-        for (first_cluster = 2;; ++first_cluster)
+        return AllocateClusters(0, n);
+    }
+
+    FileDescriptor::FileDescriptor(DirectoryEntry &fat_entry) : fat_entry_{fat_entry}
+    {
+    }
+
+    size_t FileDescriptor::Read(void *buf, size_t len)
+    {
+        const size_t total = ReadAt(rd_off_, buf, len);
+        rd_off_ += total;
+        return total;
+    }
+
+    size_t FileDescriptor::Write(const void *buf, size_t len)
+    {
+        ReserveClusters((wr_off_ + len + bytes_per_cluster - 1) / bytes_per_cluster);
+
+        const uint8_t *buf8 = reinterpret_cast<const uint8_t *>(buf);
+
+        size_t total = 0;
+        while (total < len)
         {
-            if (fat[first_cluster] == 0)
+            const size_t off = wr_off_ + total;
+            const auto cluster = ClusterAt(off / bytes_per_cluster);
+            if (cluster == kEndOfClusterchain)
+            {
+                break;
+            }
+
+            const size_t cluster_off = off % bytes_per_cluster;
+            size_t n = std::min(len - total, bytes_per_cluster - cluster_off);
+            if (WriteCluster(cluster, cluster_off, &buf8[total], n) != n)
             {
-                fat[first_cluster] = kEndOfClusterchain;
                 break;
             }
+            total += n;
         }
 
-        if (n > 1)
+        wr_off_ += total;
+        if (fat_entry_.file_size != wr_off_)
         {
-            ExtendCluster(first_cluster, n - 1);
+            fat_entry_.file_size = wr_off_;
+            MarkDirty(&fat_entry_);
         }
-        return first_cluster;
+        return total;
     }
 
-    FileDescriptor::FileDescriptor(DirectoryEntry &fat_entry_) : fat_entry_{fat_entry_}
+    size_t FileDescriptor::Load(void *buf, size_t len, size_t offset)
     {
+        return ReadAt(offset, buf, len);
     }
 
-    size_t FileDescriptor::Read(void *buf, size_t len)
+    void FileDescriptor::MapClusters(size_t num_clusters)
     {
-        if (rd_cluster_ == 0)
+        if (extents_.empty())
         {
-            rd_cluster_ = fat_entry_.FirstCluster();
+            const unsigned long first = fat_entry_.FirstCluster();
+            if (first == 0)
+            {
+                return;
+            }
+            extents_.push_back({0, first, 1});
+            num_mapped_clusters_ = 1;
         }
-        uint8_t *buf8 = reinterpret_cast<uint8_t *>(buf);
-        len = std::min(len, fat_entry_.file_size - rd_off_);
 
-        size_t total = 0;
-        while (total < len)
+        while (num_mapped_clusters_ < num_clusters)
         {
-            uint8_t *sec = GetSectorByCluster<uint8_t>(rd_cluster_);
-            size_t n = std::min(len - total, bytes_per_cluster - rd_cluster_off_);
-            memcpy(&buf8[total], &sec[rd_cluster_off_], n);
-            total += n;
+            Extent &last = extents_.back();
+            const unsigned long last_cluster = last.cluster + last.num_clusters - 1;
+            const unsigned long next = NextCluster(last_cluster);
+            if (next == kEndOfClusterchain || next == 0)
+            {
+                return;
+            }
 
-            rd_cluster_off_ += n;
-            if (rd_cluster_off_ == bytes_per_cluster)
+            if (next == last_cluster + 1)
             {
-                rd_cluster_ = NextCluster(rd_cluster_);
-                rd_cluster_off_ = 0;
+                ++last.num_clusters;
             }
+            else
+            {
+                extents_.push_back({num_mapped_clusters_, next, 1});
+            }
+            ++num_mapped_clusters_;
         }
+    }
 
-        rd_off_ += total;
-        return total;
+    unsigned long FileDescriptor::ClusterAt(size_t file_cluster)
+    {
+        MapClusters(file_cluster + 1);
+        if (file_cluster >= num_mapped_clusters_)
+        {
+            return kEndOfClusterchain;
+        }
+
+        auto it = std::upper_bound(
+            extents_.begin(), extents_.end(), file_cluster,
+            [](size_t c, const Extent &e)
+            { return c < e.file_cluster; });
+        --it;
+        return it->cluster + (file_cluster - it->file_cluster);
     }
 
-    size_t FileDescriptor::Write(const void *buf, size_t len)
+    void FileDescriptor::ReserveClusters(size_t num_clusters)
     {
-        auto num_cluster = [](size_t bytes)
+        MapClusters(num_clusters);
+        if (num_mapped_clusters_ >= num_clusters)
         {
-            return (bytes + bytes_per_cluster - 1) / bytes_per_cluster;
-        };
+            return;
+        }
 
-        if (wr_cluster_ == 0)
+        if (extents_.empty())
         {
-            if (fat_entry_.FirstCluster() != 0)
-            {
-                wr_cluster_ = fat_entry_.FirstCluster();
-            }
-            else
+            const auto first = AllocateClusterChain(num_clusters);
+            if (first == kEndOfClusterchain)
             {
-                wr_cluster_ = AllocateClusterChain(num_cluster(len));
-                fat_entry_.first_cluster_low = wr_cluster_ & 0xffff;
-                fat_entry_.first_cluster_high = (wr_cluster_ >> 16) & 0xffff;
+                return;
             }
+            fat_entry_.first_cluster_low = first & 0xffff;
+            fat_entry_.first_cluster_high = (first >> 16) & 0xffff;
+            MarkDirty(&fat_entry_);
+        }
+        else
+        {
+            const Extent &last = extents_.back();
+            ExtendCluster(last.cluster + last.num_clusters - 1,
+                          num_clusters - num_mapped_clusters_);
         }
+        MapClusters(num_clusters);
+    }
 
-        const uint8_t *buf8 = reinterpret_cast<const uint8_t *>(buf);
+    size_t FileDescriptor::ReadAt(size_t offset, void *buf, size_t len)
+    {
+        if (offset >= fat_entry_.file_size)
+        {
+            return 0;
+        }
+        len = std::min<size_t>(len, fat_entry_.file_size - offset);
+        uint8_t *buf8 = reinterpret_cast<uint8_t *>(buf);
 
         size_t total = 0;
         while (total < len)
         {
-            if (wr_cluster_off_ == bytes_per_cluster)
+            const size_t off = offset + total;
+            const auto cluster = ClusterAt(off / bytes_per_cluster);
+            if (cluster == kEndOfClusterchain)
             {
-                const auto next_cluster = NextCluster(wr_cluster_);
-                if (next_cluster == kEndOfClusterchain)
-                {
-                    wr_cluster_ = ExtendCluster(wr_cluster_, num_cluster(len - total));
-                }
-                else
-                {
-                    wr_cluster_ = next_cluster;
-                }
-                wr_cluster_off_ = 0;
+                break;
             }
 
-            uint8_t *sec = GetSectorByCluster<uint8_t>(wr_cluster_);
-            size_t n = std::min(len, bytes_per_cluster - wr_cluster_off_);
-            memcpy(&sec[wr_cluster_off_], &buf8[total], n);
+            const size_t cluster_off = off % bytes_per_cluster;
+            size_t n = std::min(len - total, bytes_per_cluster - cluster_off);
+            if (ReadCluster(cluster, cluster_off, &buf8[total], n) != n)
+            {
+                break;
+            }
             total += n;
-
-            wr_cluster_off_ += n;
         }
-
-        wr_off_ += total;
-        fat_entry_.file_size = wr_off_;
         return total;
     }
-
-    size_t FileDescriptor::Load(void *buf, size_t len, size_t offset)
-    {
-        FileDescriptor fd{fat_entry_};
-        fd.rd_off_ = offset;
-
-        unsigned long cluster = fat_entry_.FirstCluster();
-        while (offset >= bytes_per_cluster)
-        {
-            offset -= bytes_per_cluster;
-            cluster = NextCluster(cluster);
-        }
-
-        fd.rd_cluster_ = cluster;
-        fd.rd_cluster_off_ = offset;
-        return fd.Read(buf, len);
-    }
 } // namespace fat
@@ -7,9 +7,12 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <vector>
 
+#include "block_device.hpp"
 #include "error.hpp"
 #include "file.hpp"
+#include "slab.hpp"
 
 namespace fat
 {
@@ -44,6 +47,23 @@ namespace fat
         char fs_type[8];
     } __attribute__((packed));
 
+    /** @brief The FSInfo sector of FAT32, whose counts are hints which may be stale */
+    struct FSInfo
+    {
+        static const uint32_t kLeadSignature = 0x41615252;
+        static const uint32_t kStructSignature = 0x61417272;
+        /** @brief free_count and next_free of this value are not known */
+        static const uint32_t kUnknownCount = 0xffffffff;
+
+        uint32_t lead_signature;
+        uint8_t reserved[480];
+        uint32_t struct_signature;
+        uint32_t free_count;
+        uint32_t next_free;
+        uint8_t reserved1[12];
+        uint32_t trail_signature;
+    } __attribute__((packed));
+
     enum class Attribute : uint8_t
     {
         kReadOnly = 0x01,
@@ -77,18 +97,46 @@ namespace fat
         }
     } __attribute__((packed));
 
-    extern BPB *boot_volume_image;
+    /** @brief A copy of the BPB of the boot volume */
+    extern BPB boot_volume_bpb;
     extern unsigned long bytes_per_cluster;
-    void Initialize(void *volume_image);
+
+    /** @brief Default byte size of the cache of clusters, not counting pinned clusters */
+    const size_t kDefaultVolumeCacheBytes = 1024 * 1024;
+    /** @brief Default byte size of the cache of the reserved sectors and FAT */
+    const size_t kDefaultSectorCacheBytes = 64 * 1024;
+
+    /**
+     * @brief Mount the volume on the device
+     *
+     * Clusters are read through a BlockCache of clusters on demand, and the reserved sectors and FAT
+     * through another one of sectors. They are written back to the device by Sync() or when they are evicted.
+     * FAT is read through once to make the bitmap of free clusters.
+     */
+    Error Initialize(BlockDevice &device);
+
+    /** @brief Write all the modified clusters and FAT sectors, and the counts in FSInfo back to the device */
+    Error Sync();
+
+    unsigned long NumFreeClusters();
+
+    BlockCacheStat VolumeCacheStat();
 
     /**
      * @brief Get the address of a given cluster
      *
+     * The cluster is pinned in the cache, so the address stays valid. Writes through it are
+     * written back by Sync() after MarkDirty() tells about them.
+     * This is meant for directories, whose entries are referred by pointers.
+     *
      * @param cluster Cluster number (starting from 2)
-     * @return Address of the top sector for the cluster
+     * @return Address of the top sector for the cluster, or 0 if the cluster cannot be read
      */
     uintptr_t GetClusterAddr(unsigned long cluster);
 
+    /** @brief Tell that the data at the address given by GetClusterAddr() has been written */
+    void MarkDirty(const void *p);
+
     /**
      * @brief Get the sector of a given cluster
      *
@@ -159,11 +207,12 @@ namespace fat
 
     bool IsEndOfClusterchain(unsigned long cluster);
 
-    uint32_t *GetFAT();
-
     /**
      * @brief Extend the cluster chain by n clusters
      *
+     * Free clusters are found in a bitmap made at mount.
+     * Clusters right after the chain are preferred, and then a run of n free clusters.
+     *
      * @param eoc_cluster The last cluster of the current chain (kEndOfClusterchain if the chain is empty)
      * @param n Number of clusters to extend
      * @return The first cluster number of the extended part, or kEndOfClusterchain
@@ -198,10 +247,18 @@ namespace fat
      * @brief Allocate a cluster chain with the specified length
      *
      * @param n Number of clusters to allocate
-     * @return The first cluster number of the allocated chain
+     * @return The first cluster number of the allocated chain, or kEndOfClusterchain if the volume is full
      */
     unsigned long AllocateClusterChain(size_t n);
 
+    /**
+     * @brief Open file on the FAT volume
+     *
+     * The descriptor maps offsets of the file to clusters with runs of contiguous clusters.
+     * The map is made by walking the cluster chain as far as accesses need, and kept while the file is open,
+     * so Read(), Write() and Load() find the cluster of any offset by a binary search over the runs.
+     * Cluster chains only grow, so the map stays valid while other descriptors extend the file.
+     */
     class FileDescriptor : public ::FileDescriptor
     {
     public:
@@ -212,12 +269,32 @@ namespace fat
         size_t Load(void *buf, size_t len, size_t offset) override;
 
     private:
+        /** @brief num_clusters contiguous clusters from cluster, which are from the file_cluster-th of the file */
+        struct Extent
+        {
+            size_t file_cluster;
+            unsigned long cluster;
+            size_t num_clusters;
+        };
+
         DirectoryEntry &fat_entry_;
         size_t rd_off_ = 0;
-        unsigned long rd_cluster_ = 0;
-        size_t rd_cluster_off_ = 0;
         size_t wr_off_ = 0;
-        unsigned long wr_cluster_ = 0;
-        size_t wr_cluster_off_ = 0;
+        /** @brief Runs of the head of the cluster chain in the order of file_cluster */
+        std::vector<Extent> extents_;
+        /** @brief The number of clusters which extents_ covers */
+        size_t num_mapped_clusters_ = 0;
+
+        /** @brief Walk the chain until extents_ covers num_clusters clusters or the chain ends */
+        void MapClusters(size_t num_clusters);
+        /** @brief The file_cluster-th cluster of the file, or kEndOfClusterchain if the chain is shorter */
+        unsigned long ClusterAt(size_t file_cluster);
+        /** @brief Allocate clusters so that the chain has num_clusters clusters */
+        void ReserveClusters(size_t num_clusters);
+        size_t ReadAt(size_t offset, void *buf, size_t len);
     };
+
+    inline constexpr char kFileDescriptorSlabName[] = "fat::FileDescriptor";
+    /** @brief Allocator to create FileDescriptor by std::allocate_shared */
+    using FileDescriptorAllocator = SlabAllocator<FileDescriptor, kFileDescriptorSlabName>;
 } // namespace fat
@@ -17,6 +17,12 @@ public:
      * @brief Load reads file content without changing internal offset
      */
     virtual size_t Load(void *buf, size_t len, size_t offset) = 0;
+
+    /** @brief Write out data buffered by Write(), called before the writing task blocks */
+    virtual void Flush() {}
+
+    /** @brief Give up the descriptor so that the other end of a channel, such as a pipe, sees the end */
+    virtual void Close() {}
 };
 
 size_t PrintToFD(FileDescriptor &fd, const char *format, ...);
@@ -5,10 +5,17 @@
 
 #include "font.hpp"
 
+#include <algorithm>
+#include <array>
+#include <bitset>
 #include <cstdlib>
+#include <cstring>
+#include <list>
+#include <unordered_map>
 #include <vector>
 
 #include "fat.hpp"
+#include "interrupt.hpp"
 
 extern const uint8_t _binary_hankaku_bin_start;
 extern const uint8_t _binary_hankaku_bin_end;
@@ -26,8 +33,210 @@ namespace
         return &_binary_hankaku_bin_start + index;
     }
 
+    /** @brief Write the foreground pixels of a character one by one */
+    void WriteAsciiPixels(PixelWriter &writer, Vector2D<int> pos, char c, const PixelColor &color)
+    {
+        const uint8_t *font = GetFont(c);
+        if (font == nullptr)
+        {
+            return;
+        }
+
+        for (int dy = 0; dy < 16; ++dy)
+        {
+            for (int dx = 0; dx < 8; ++dx)
+            {
+                if ((font[dy] << dx) & 0x80u)
+                {
+                    writer.Write(pos + Vector2D<int>{dx, dy}, color);
+                }
+            }
+        }
+    }
+
+    const int kAsciiGlyphs = 128;
+
+    /**
+     * @brief Hankaku glyphs expanded into native pixels of a pair of colors
+     *
+     * A glyph is expanded on its first use.
+     * Transparent text uses the complement of the foreground as the background,
+     * which is never a native pixel, and is written by BlendSpan with it as the key.
+     */
+    struct AsciiAtlas
+    {
+        uint32_t fg, bg;
+        uint64_t last_use;
+        std::bitset<kAsciiGlyphs> expanded;
+        std::array<std::array<uint32_t, 8 * 16>, kAsciiGlyphs> glyphs;
+
+        const uint32_t *Pixels(char c)
+        {
+            const uint8_t index = static_cast<uint8_t>(c) < kAsciiGlyphs ? c : ' ';
+            auto &pixels = glyphs[index];
+            if (!expanded[index])
+            {
+                const uint8_t *font = GetFont(index);
+                for (int dy = 0; dy < 16; ++dy)
+                {
+                    for (int dx = 0; dx < 8; ++dx)
+                    {
+                        const bool set = font && ((font[dy] << dx) & 0x80u);
+                        pixels[8 * dy + dx] = set ? fg : bg;
+                    }
+                }
+                expanded[index] = true;
+            }
+            return pixels.data();
+        }
+    };
+
+    /** @brief Atlases of recently used color pairs, each of which takes 64 KiB */
+    std::array<AsciiAtlas *, 4> ascii_atlases;
+    uint64_t ascii_atlas_clock;
+
+    AsciiAtlas &FindAsciiAtlas(uint32_t fg, uint32_t bg)
+    {
+        AsciiAtlas **victim = &ascii_atlases[0];
+        for (auto &atlas : ascii_atlases)
+        {
+            if (atlas && atlas->fg == fg && atlas->bg == bg)
+            {
+                atlas->last_use = ++ascii_atlas_clock;
+                return *atlas;
+            }
+            if (*victim && (atlas == nullptr || atlas->last_use < (*victim)->last_use))
+            {
+                victim = &atlas;
+            }
+        }
+
+        if (*victim == nullptr)
+        {
+            *victim = new AsciiAtlas;
+        }
+        auto &atlas = **victim;
+        atlas.fg = fg;
+        atlas.bg = bg;
+        atlas.last_use = ++ascii_atlas_clock;
+        atlas.expanded.reset();
+        return atlas;
+    }
+
+    /**
+     * @brief Write n ASCII characters in a line
+     *
+     * Each row of pixels of the whole line is assembled from the atlas and written by one span,
+     * so the text is opaque if bg is given, transparent otherwise.
+     */
+    void WriteAsciiRun(PixelWriter &writer, Vector2D<int> pos, const char *s, int n,
+                       const PixelColor &fg, const PixelColor *bg)
+    {
+        auto native = writer.Native();
+        if (native == nullptr)
+        {
+            for (int i = 0; i < n; ++i)
+            {
+                const Vector2D<int> char_pos = pos + Vector2D<int>{8 * i, 0};
+                if (bg)
+                {
+                    FillRectangle(writer, char_pos, {8, 16}, *bg);
+                }
+                WriteAsciiPixels(writer, char_pos, s[i], fg);
+            }
+            return;
+        }
+
+        const uint32_t fg_native = native->ToNative(fg);
+        const uint32_t bg_native = bg ? native->ToNative(*bg) : ~fg_native;
+        const int y_begin = std::max(pos.y, 0) - pos.y;
+        const int y_end = std::min(pos.y + 16, native->Height()) - pos.y;
+
+        const int kLineChars = 32;
+        std::array<const uint32_t *, kLineChars> glyphs;
+        std::array<uint32_t, 8 * kLineChars> line;
+
+        // Atlases are shared by all tasks
+        const auto rflags = DisableInterrupts();
+        auto &atlas = FindAsciiAtlas(fg_native, bg_native);
+        for (int first = 0; first < n; first += kLineChars)
+        {
+            const int chars = std::min(n - first, kLineChars);
+            const int x = pos.x + 8 * first;
+            const int x_begin = std::max(x, 0);
+            const int x_end = std::min(x + 8 * chars, native->Width());
+            if (x_begin >= x_end)
+            {
+                continue;
+            }
+
+            for (int i = 0; i < chars; ++i)
+            {
+                glyphs[i] = atlas.Pixels(s[first + i]);
+            }
+            for (int dy = y_begin; dy < y_end; ++dy)
+            {
+                for (int i = 0; i < chars; ++i)
+                {
+                    memcpy(&line[8 * i], glyphs[i] + 8 * dy, 8 * sizeof(uint32_t));
+                }
+                const Vector2D<int> span_pos{x_begin, pos.y + dy};
+                const uint32_t *src = &line[x_begin - x];
+                if (bg)
+                {
+                    native->CopySpan(span_pos, src, x_end - x_begin);
+                }
+                else
+                {
+                    native->BlendSpan(span_pos, src, x_end - x_begin, bg_native);
+                }
+            }
+        }
+        RestoreInterrupts(rflags);
+    }
+
+    void WriteStringImpl(PixelWriter &writer, Vector2D<int> pos, const char *s,
+                         const PixelColor &fg, const PixelColor *bg)
+    {
+        int x = 0;
+        while (*s)
+        {
+            // A run of ASCII characters is written at once
+            int n = 0;
+            while (s[n] && CountUTF8Size(s[n]) == 1)
+            {
+                ++n;
+            }
+            if (n > 0)
+            {
+                WriteAsciiRun(writer, pos + Vector2D<int>{8 * x, 0}, s, n, fg, bg);
+                s += n;
+                x += n;
+                continue;
+            }
+
+            auto [u32, bytes] = ConvertUTF8To32(s);
+            if (bytes == 0)
+            {
+                // Skip a broken byte of UTF-8
+                bytes = 1;
+            }
+            const Vector2D<int> char_pos = pos + Vector2D<int>{8 * x, 0};
+            if (bg)
+            {
+                FillRectangle(writer, char_pos, {IsHankaku(u32) ? 8 : 16, 16}, *bg);
+            }
+            WriteUnicode(writer, char_pos, u32, fg);
+            s += bytes;
+            x += IsHankaku(u32) ? 1 : 2;
+        }
+    }
+
     FT_Library ft_library;
     std::vector<uint8_t> *nihongo_buf;
+    /** @brief The face shared by all glyphs, set to the size of the last rendered glyph */
+    FT_Face nihongo_face;
+    int nihongo_face_size;
 
     Error RenderUnicode(char32_t c, FT_Face face)
     {
@@ -45,38 +254,191 @@ namespace
         }
         return MAKE_ERROR(Error::kSuccess);
     }
-} // namespace
 
-void WriteAscii(PixelWriter &writer, Vector2D<int> pos, char c, const PixelColor &color)
-{
-    const uint8_t *font = GetFont(c);
-    if (font == nullptr)
+    /** @brief A rendered glyph in 1 bit per pixel, the most significant bit first */
+    struct Glyph
     {
-        return;
-    }
+        uint64_t key;
+        /** @brief False if the font has no glyph for the character */
+        bool valid;
+        /** @brief Top-left corner of the bitmap from the top-left corner of the cell */
+        Vector2D<int> offset;
+        int width, rows, pitch;
+        std::vector<uint8_t> bits;
+    };
+
+    /**
+     * @brief LRU cache of glyphs keyed by the character, the size and the style
+     *
+     * Glyphs are listed in the order of use, and the hash map finds the list node of a key.
+     * A glyph which the font does not have is cached as well, so it is not looked up again.
+     */
+    class GlyphCache
+    {
+    public:
+        GlyphCache(size_t budget_bytes) : budget_bytes_{budget_bytes} {}
+
+        const Glyph &Get(char32_t c, int size, FontStyle style)
+        {
+            const uint64_t key = static_cast<uint64_t>(c) |
+                                 static_cast<uint64_t>(size) << 32 |
+                                 static_cast<uint64_t>(style) << 48;
+            if (auto it = index_.find(key); it != index_.end())
+            {
+                ++hits_;
+                glyphs_.splice(glyphs_.begin(), glyphs_, it->second);
+                return *it->second;
+            }
+
+            ++misses_;
+            glyphs_.push_front(Render(key, c, size, style));
+            index_[key] = glyphs_.begin();
+            used_bytes_ += Bytes(glyphs_.front());
+            Evict();
+            return glyphs_.front();
+        }
+
+        void SetBudget(size_t bytes)
+        {
+            budget_bytes_ = bytes;
+            Evict();
+        }
+
+        GlyphCacheStat Stat() const
+        {
+            return {hits_, misses_, evictions_, glyphs_.size(), used_bytes_, budget_bytes_};
+        }
+
+    private:
+        /** @brief Bytes taken by a node of the list and that of the hash map are included roughly */
+        static const size_t kNodeBytes = 64;
+
+        std::list<Glyph> glyphs_{};
+        std::unordered_map<uint64_t, std::list<Glyph>::iterator> index_{};
+        size_t budget_bytes_;
+        size_t used_bytes_{0};
+        size_t hits_{0}, misses_{0}, evictions_{0};
+
+        static size_t Bytes(const Glyph &g)
+        {
+            return sizeof(Glyph) + kNodeBytes + g.bits.size();
+        }
+
+        /** @brief Drop least recently used glyphs over the budget, but keep the most recent one */
+        void Evict()
+        {
+            while (used_bytes_ > budget_bytes_ && glyphs_.size() > 1)
+            {
+                const Glyph &g = glyphs_.back();
+                used_bytes_ -= Bytes(g);
+                index_.erase(g.key);
+                glyphs_.pop_back();
+                ++evictions_;
+            }
+        }
+
+        static Glyph Render(uint64_t key, char32_t c, int size, FontStyle style)
+        {
+            Glyph g{key, false, {0, 0}, 0, 0, 0, {}};
+            if (nihongo_face_size != size)
+            {
+                if (FT_Set_Pixel_Sizes(nihongo_face, size, size))
+                {
+                    return g;
+                }
+                nihongo_face_size = size;
+            }
+            if (RenderUnicode(c, nihongo_face))
+            {
+                return g;
+            }
 
-    for (int dy = 0; dy < 16; ++dy)
+            const FT_Face face = nihongo_face;
+            const FT_Bitmap &bitmap = face->glyph->bitmap;
+            const int baseline = (face->height + face->descender) *
+                                 face->size->metrics.y_ppem / face->units_per_EM;
+            const bool bold = style == FontStyle::kBold;
+
+            g.valid = true;
+            g.offset = {face->glyph->bitmap_left, baseline - face->glyph->bitmap_top};
+            g.width = bitmap.width + (bold ? 1 : 0);
+            g.rows = bitmap.rows;
+            g.pitch = (g.width + 7) / 8;
+            g.bits.resize(g.pitch * g.rows);
+            for (int dy = 0; dy < g.rows; ++dy)
+            {
+                const unsigned char *q = &bitmap.buffer[bitmap.pitch * dy];
+                if (bitmap.pitch < 0)
+                {
+                    q -= bitmap.pitch * bitmap.rows;
+                }
+                uint8_t *row = &g.bits[g.pitch * dy];
+                for (int dx = 0; dx < bitmap.width; ++dx)
+                {
+                    if ((q[dx >> 3] & (0x80 >> (dx & 0x7))) == 0)
+                    {
+                        continue;
+                    }
+                    row[dx >> 3] |= 0x80 >> (dx & 0x7);
+                    if (bold)
+                    {
+                        row[(dx + 1) >> 3] |= 0x80 >> ((dx + 1) & 0x7);
+                    }
+                }
+            }
+            return g;
+        }
+    };
+
+    GlyphCache *glyph_cache;
+
+    /** @brief Write each run of set bits in a row of the glyph as a span */
+    void DrawGlyph(PixelWriter &writer, Vector2D<int> pos, const Glyph &g,
+                   const PixelColor &color)
     {
-        for (int dx = 0; dx < 8; ++dx)
+        const auto topleft = pos + g.offset;
+        for (int dy = 0; dy < g.rows; ++dy)
         {
-            if ((font[dy] << dx) & 0x80u)
+            const uint8_t *row = &g.bits[g.pitch * dy];
+            int dx = 0;
+            while (dx < g.width)
             {
-                writer.Write(pos + Vector2D<int>{dx, dy}, color);
+                if ((row[dx >> 3] & (0x80 >> (dx & 0x7))) == 0)
+                {
+                    ++dx;
+                    continue;
+                }
+                const int begin = dx;
+                while (dx < g.width && (row[dx >> 3] & (0x80 >> (dx & 0x7))))
+                {
+                    ++dx;
+                }
+                writer.FillSpan(topleft + Vector2D<int>{begin, dy}, dx - begin, color);
             }
         }
     }
-};
+} // namespace
+
+void WriteAscii(PixelWriter &writer, Vector2D<int> pos, char c, const PixelColor &color)
+{
+    WriteAsciiRun(writer, pos, &c, 1, color, nullptr);
+}
+
+void WriteAscii(PixelWriter &writer, Vector2D<int> pos, char c,
+                const PixelColor &fg, const PixelColor &bg)
+{
+    WriteAsciiRun(writer, pos, &c, 1, fg, &bg);
+}
 
 void WriteString(PixelWriter &writer, Vector2D<int> pos, const char *s, const PixelColor &color)
 {
-    int x = 0;
-    while (*s)
-    {
-        const auto [u32, bytes] = ConvertUTF8To32(s);
-        WriteUnicode(writer, pos + Vector2D<int>{8 * x, 0}, u32, color);
-        s += bytes;
-        x += IsHankaku(u32) ? 1 : 2;
-    }
+    WriteStringImpl(writer, pos, s, color, nullptr);
+}
+
+void WriteString(PixelWriter &writer, Vector2D<int> pos, const char *s,
+                 const PixelColor &fg, const PixelColor &bg)
+{
+    WriteStringImpl(writer, pos, s, fg, &bg);
 }
 
 int CountUTF8Size(uint8_t c)
@@ -163,7 +525,8 @@ WithError<FT_Face> NewFTFace()
 }
 
 Error WriteUnicode(PixelWriter &writer, Vector2D<int> pos,
-                   char32_t c, const PixelColor &color)
+                   char32_t c, const PixelColor &color,
+                   int size, FontStyle style)
 {
     if (IsHankaku(c))
     {
@@ -171,46 +534,39 @@ Error WriteUnicode(PixelWriter &writer, Vector2D<int> pos,
         return MAKE_ERROR(Error::kSuccess);
     }
 
-    auto [face, err] = NewFTFace();
-    if (err)
+    // The face and the cache are shared by all tasks
+    const auto rflags = DisableInterrupts();
+    const Glyph &glyph = glyph_cache->Get(c, size, style);
+    // Another task may evict the glyph once interrupts are enabled
+    const bool valid = glyph.valid;
+    if (valid)
     {
-        WriteAscii(writer, pos, '?', color);
-        WriteAscii(writer, pos + Vector2D<int>{8, 0}, '?', color);
-        return err;
+        DrawGlyph(writer, pos, glyph, color);
     }
-    if (auto err = RenderUnicode(c, face))
+    RestoreInterrupts(rflags);
+
+    if (!valid)
     {
-        FT_Done_Face(face);
         WriteAscii(writer, pos, '?', color);
         WriteAscii(writer, pos + Vector2D<int>{8, 0}, '?', color);
-        return err;
+        return MAKE_ERROR(Error::kFreeTypeError);
     }
-    FT_Bitmap &bitmap = face->glyph->bitmap;
+    return MAKE_ERROR(Error::kSuccess);
+}
 
-    const int baseline = (face->height + face->descender) *
-                         face->size->metrics.y_ppem / face->units_per_EM;
-    const auto glyph_topleft = pos + Vector2D<int>{
-                                         face->glyph->bitmap_left,
-                                         baseline - face->glyph->bitmap_top};
-    for (int dy = 0; dy < bitmap.rows; ++dy)
-    {
-        unsigned char *q = &bitmap.buffer[bitmap.pitch * dy];
-        if (bitmap.pitch < 0)
-        {
-            q -= bitmap.pitch * bitmap.rows;
-        }
-        for (int dx = 0; dx < bitmap.width; ++dx)
-        {
-            const bool b = q[dx >> 3] & (0x80 >> (dx & 0x7));
-            if (b)
-            {
-                writer.Write(glyph_topleft + Vector2D<int>{dx, dy}, color);
-            }
-        }
-    }
+void SetGlyphCacheBudget(size_t bytes)
+{
+    const auto rflags = DisableInterrupts();
+    glyph_cache->SetBudget(bytes);
+    RestoreInterrupts(rflags);
+}
 
-    FT_Done_Face(face);
-    return MAKE_ERROR(Error::kSuccess);
+GlyphCacheStat GetGlyphCacheStat()
+{
+    const auto rflags = DisableInterrupts();
+    const auto stat = glyph_cache->Stat();
+    RestoreInterrupts(rflags);
+    return stat;
 }
 
 void InitializeFont()
@@ -233,4 +589,13 @@ void InitializeFont()
         delete nihongo_buf;
         exit(1);
     }
+
+    auto [face, err] = NewFTFace();
+    if (err)
+    {
+        exit(1);
+    }
+    nihongo_face = face;
+    nihongo_face_size = 16;
+    glyph_cache = new GlyphCache{kDefaultGlyphCacheBytes};
 }
\ No newline at end of file
@@ -9,13 +9,54 @@
 #include "graphics.hpp"
 #include "error.hpp"
 
+/**
+ * @brief Write an 8x16 character, leaving pixels other than the glyph as they are
+ *
+ * ASCII text is blitted in native pixels from glyphs expanded for its colors
+ * if the writer has a native frame buffer writer.
+ */
 void WriteAscii(PixelWriter &writer, Vector2D<int> pos, char c, const PixelColor &color);
+/** @brief Write an 8x16 character and fill the rest of its cell with bg */
+void WriteAscii(PixelWriter &writer, Vector2D<int> pos, char c,
+                const PixelColor &fg, const PixelColor &bg);
 void WriteString(PixelWriter &writer, Vector2D<int> pos, const char *s, const PixelColor &color);
+/** @brief Write a string and fill the rest of the cells of its characters with bg */
+void WriteString(PixelWriter &writer, Vector2D<int> pos, const char *s,
+                 const PixelColor &fg, const PixelColor &bg);
 
 int CountUTF8Size(uint8_t c);
 std::pair<char32_t, int> ConvertUTF8To32(const char *u8);
 bool IsHankaku(char32_t c);
 WithError<FT_Face> NewFTFace();
+
+enum class FontStyle : uint8_t
+{
+    kRegular,
+    /** @brief Regular glyphs thickened by one pixel to the right */
+    kBold,
+};
+
+/**
+ * @brief Write a character at pos, the top-left corner of its cell
+ *
+ * Characters other than ASCII are rendered by FreeType in size pixels,
+ * and their bitmaps are kept in the glyph cache for later calls.
+ */
 Error WriteUnicode(PixelWriter &writer, Vector2D<int> pos,
-                   char32_t c, const PixelColor &color);
+                   char32_t c, const PixelColor &color,
+                   int size = 16, FontStyle style = FontStyle::kRegular);
+
+struct GlyphCacheStat
+{
+    size_t hits, misses, evictions;
+    size_t num_glyphs;
+    size_t used_bytes, budget_bytes;
+};
+
+/** @brief Default memory budget of the glyph cache */
+const size_t kDefaultGlyphCacheBytes = 256 * 1024;
+/** @brief Change the memory budget of the glyph cache, least recently used glyphs over it are evicted */
+void SetGlyphCacheBudget(size_t bytes);
+GlyphCacheStat GetGlyphCacheStat();
+
 void InitializeFont();
\ No newline at end of file
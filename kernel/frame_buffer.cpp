@@ -72,6 +72,24 @@ Error FrameBuffer::Initialize(const FrameBufferConfig &config)
 
 Error FrameBuffer::Copy(Vector2D<int> dst_pos, const FrameBuffer &src,
                         const Rectangle<int> &src_area)
+{
+    return CopyRows(dst_pos, src, src_area,
+                    [](uint32_t *dst, const uint32_t *src, int n)
+                    { CopyPixels(dst, src, n); });
+}
+
+Error FrameBuffer::Blend(Vector2D<int> dst_pos, const FrameBuffer &src,
+                         const Rectangle<int> &src_area, const PixelColor &key)
+{
+    const uint32_t native_key = src.writer_->ToNative(key);
+    return CopyRows(dst_pos, src, src_area,
+                    [native_key](uint32_t *dst, const uint32_t *src, int n)
+                    { BlendPixels(dst, src, n, native_key); });
+}
+
+template <class Func>
+Error FrameBuffer::CopyRows(Vector2D<int> dst_pos, const FrameBuffer &src,
+                            const Rectangle<int> &src_area, Func copy_row)
 {
     if (config_.pixel_format != src.config_.pixel_format)
     {
@@ -95,7 +113,9 @@ Error FrameBuffer::Copy(Vector2D<int> dst_pos, const FrameBuffer &src,
 
     for (int y = 0; y < copy_area.size.y; ++y)
     {
-        memcpy(dst_buf, src_buf, bytes_per_pixel * copy_area.size.x);
+        // Both formats have 32-bit pixels
+        copy_row(reinterpret_cast<uint32_t *>(dst_buf),
+                 reinterpret_cast<const uint32_t *>(src_buf), copy_area.size.x);
         dst_buf += BytesPerScanLine(config_);
         src_buf += BytesPerScanLine(src.config_);
     }
@@ -13,13 +13,22 @@ class FrameBuffer
 public:
     Error Initialize(const FrameBufferConfig &config);
     Error Copy(Vector2D<int> dst_pos, const FrameBuffer &src, const Rectangle<int> &src_area);
+    /** @brief Copy like Copy() except pixels of src equal to the color key, which leave this as is */
+    Error Blend(Vector2D<int> dst_pos, const FrameBuffer &src, const Rectangle<int> &src_area,
+                const PixelColor &key);
     void Move(Vector2D<int> dst_pos, const Rectangle<int> &src);
 
     FrameBufferWriter &Writer() { return *writer_; }
+    const FrameBufferWriter &Writer() const { return *writer_; }
     const FrameBufferConfig &Config() const { return config_; }
 
 private:
     FrameBufferConfig config_{};
     std::vector<uint8_t> buffer_{};
     std::unique_ptr<FrameBufferWriter> writer_{};
+
+    /** @brief Clip the area, then pass each pair of rows to copy_row(dst, src, num_pixels) */
+    template <class Func>
+    Error CopyRows(Vector2D<int> dst_pos, const FrameBuffer &src, const Rectangle<int> &src_area,
+                   Func copy_row);
 };
\ No newline at end of file
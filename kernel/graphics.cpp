@@ -6,20 +6,91 @@
 
 #include "graphics.hpp"
 
+#include <algorithm>
+#include <cstdlib>
+#include <emmintrin.h>
+
+// The kernel saves SSE registers on task switches, so SSE2 is available everywhere.
+// AVX is not used since the kernel does not enable XSAVE.
+
+void FillPixels(uint32_t *dst, int n, uint32_t value)
+{
+    int i = 0;
+    for (; i < n && (reinterpret_cast<uintptr_t>(dst + i) & 15) != 0; ++i)
+    {
+        dst[i] = value;
+    }
+
+    const __m128i v = _mm_set1_epi32(value);
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm_store_si128(reinterpret_cast<__m128i *>(dst + i), v);
+        _mm_store_si128(reinterpret_cast<__m128i *>(dst + i + 4), v);
+    }
+    for (; i < n; ++i)
+    {
+        dst[i] = value;
+    }
+}
+
+void CopyPixels(uint32_t *dst, const uint32_t *src, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), a);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 4), b);
+    }
+    for (; i < n; ++i)
+    {
+        dst[i] = src[i];
+    }
+}
+
+void BlendPixels(uint32_t *dst, const uint32_t *src, int n, uint32_t key)
+{
+    int i = 0;
+    const __m128i k = _mm_set1_epi32(key);
+    for (; i + 4 <= n; i += 4)
+    {
+        const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        const __m128i transparent = _mm_cmpeq_epi32(s, k);
+        if (_mm_movemask_epi8(transparent) == 0xffff)
+        {
+            continue;
+        }
+        const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+        const __m128i mixed = _mm_or_si128(_mm_and_si128(transparent, d),
+                                           _mm_andnot_si128(transparent, s));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), mixed);
+    }
+    for (; i < n; ++i)
+    {
+        if (src[i] != key)
+        {
+            dst[i] = src[i];
+        }
+    }
+}
+
+void PixelWriter::FillSpan(Vector2D<int> pos, int len, const PixelColor &c)
+{
+    for (int dx = 0; dx < len; ++dx)
+    {
+        Write(pos + Vector2D<int>{dx, 0}, c);
+    }
+}
+
 void RGBResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor &c)
 {
-    auto p = PixelAt(pos);
-    p[0] = c.r;
-    p[1] = c.g;
-    p[2] = c.b;
+    *PixelAt(pos) = ToNative(c);
 }
 
 void BGRResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor &c)
 {
-    auto p = PixelAt(pos);
-    p[0] = c.b;
-    p[1] = c.g;
-    p[2] = c.r;
+    *PixelAt(pos) = ToNative(c);
 }
 
 void DrawRectangle(PixelWriter &writer, const Vector2D<int> &pos,
@@ -40,11 +111,262 @@ void DrawRectangle(PixelWriter &writer, const Vector2D<int> &pos,
 void FillRectangle(PixelWriter &writer, const Vector2D<int> &pos,
                    const Vector2D<int> &size, const PixelColor &c)
 {
-    for (int dy = 0; dy < size.y; ++dy)
+    // Spans must be inside the writer
+    const int x0 = std::max(pos.x, 0);
+    const int y0 = std::max(pos.y, 0);
+    const int x1 = std::min(pos.x + size.x, writer.Width());
+    const int y1 = std::min(pos.y + size.y, writer.Height());
+    if (x0 >= x1)
+    {
+        return;
+    }
+
+    for (int y = y0; y < y1; ++y)
+    {
+        writer.FillSpan({x0, y}, x1 - x0, c);
+    }
+}
+
+namespace
+{
+    /** @brief Round a / b toward positive infinity, where b > 0 */
+    int64_t CeilDiv(int64_t a, int64_t b)
+    {
+        return a >= 0 ? (a + b - 1) / b : -(-a / b);
+    }
+
+    /** @brief Mix fg into bg by alpha of 0 to 256 */
+    PixelColor Mix(const PixelColor &fg, const PixelColor &bg, int alpha)
+    {
+        auto mix = [alpha](uint8_t f, uint8_t b)
+        {
+            return static_cast<uint8_t>((f * alpha + b * (256 - alpha)) >> 8);
+        };
+        return {mix(fg.r, bg.r), mix(fg.g, bg.g), mix(fg.b, bg.b)};
+    }
+
+    /** @brief Longer lines are split so that the clipping math fits in 64 bits */
+    const int64_t kMaxLineLength = 1 << 28;
+}
+
+void DrawLine(PixelWriter &writer, Vector2D<int> p0, Vector2D<int> p1, const PixelColor &c, int width)
+{
+    int x0 = p0.x, y0 = p0.y, x1 = p1.x, y1 = p1.y;
+    int64_t dx = static_cast<int64_t>(x1) - x0, dy = static_cast<int64_t>(y1) - y0;
+    if (std::max(std::abs(dx), std::abs(dy)) > kMaxLineLength)
+    {
+        const int xm = x0 + dx / 2, ym = y0 + dy / 2;
+        DrawLine(writer, {x0, y0}, {xm, ym}, c, width);
+        DrawLine(writer, {xm, ym}, {x1, y1}, c, width);
+        return;
+    }
+
+    const bool x_major = std::abs(dx) >= std::abs(dy);
+    if ((x_major ? dx : dy) < 0)
+    {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+        dx = -dx;
+        dy = -dy;
+    }
+
+    // u is the major axis, v is the minor one
+    const int64_t u0 = x_major ? x0 : y0, v0 = x_major ? y0 : x0;
+    const int64_t du = x_major ? dx : dy;
+    const int64_t dv = x_major ? dy : dx;
+    const int64_t adv = std::abs(dv);
+    const int v_step = dv < 0 ? -1 : 1;
+    const int64_t u_limit = x_major ? writer.Width() : writer.Height();
+    const int64_t v_limit = x_major ? writer.Height() : writer.Width();
+    // The band of a thick line spreads half_lo pixels toward smaller v and half_hi toward larger v
+    const int half_lo = width / 2, half_hi = width - 1 - width / 2;
+
+    int64_t i_begin = std::max<int64_t>(0, -u0);
+    int64_t i_end = std::min<int64_t>(du, u_limit - 1 - u0);
+
+    // Range of the minor offset k whose band is at least partially visible
+    int64_t k_lo, k_hi;
+    if (v_step > 0)
+    {
+        k_lo = -half_hi - v0;
+        k_hi = v_limit - 1 + half_lo - v0;
+    }
+    else
+    {
+        k_lo = v0 - (v_limit - 1 + half_lo);
+        k_hi = v0 + half_hi;
+    }
+    k_lo = std::max<int64_t>(k_lo, 0);
+    k_hi = std::min<int64_t>(k_hi, adv);
+    if (k_lo > k_hi)
+    {
+        return;
+    }
+    // Only a band cut by the writer needs the division
+    if (adv > 0 && (k_lo > 0 || k_hi < adv))
+    {
+        i_begin = std::max(i_begin, CeilDiv(2 * du * k_lo - du, 2 * adv));
+        i_end = std::min(i_end, CeilDiv(2 * du * (k_hi + 1) - du, 2 * adv) - 1);
+    }
+    if (i_begin > i_end)
+    {
+        return;
+    }
+
+    // Runs are inside the writer on the major axis, and the band is clipped on the minor axis here.
+    // Most runs of steep lines are single pixels, which skip the span setup.
+    auto span = [&](Vector2D<int> pos, int n)
+    {
+        if (n == 1)
+        {
+            writer.Write(pos, c);
+        }
+        else
+        {
+            writer.FillSpan(pos, n, c);
+        }
+    };
+    auto emit = [&](int64_t i, int64_t len, int64_t k)
+    {
+        const int u = u0 + i;
+        const int v_begin = std::max<int64_t>(v0 + v_step * k - half_lo, 0);
+        const int v_end = std::min<int64_t>(v0 + v_step * k + half_hi + 1, v_limit);
+        if (x_major)
+        {
+            for (int v = v_begin; v < v_end; ++v)
+            {
+                span({u, v}, len);
+            }
+        }
+        else
+        {
+            for (int j = 0; j < len; ++j)
+            {
+                span({v_begin, u + j}, v_end - v_begin);
+            }
+        }
+    };
+
+    const int64_t den = 2 * du;
+    if (den == 0)
+    {
+        emit(0, 1, 0);
+        return;
+    }
+    int64_t k = 0, err = du;
+    if (i_begin > 0)
+    {
+        const int64_t num = 2 * i_begin * adv + du;
+        k = num / den;
+        err = num % den;
+    }
+
+    // Runs of a line of width 1 closer to diagonal are mostly single pixels, and rows of a steep line
+    // always are. Such lines are written by pixels, stepping without branches which would mispredict.
+    if (width == 1 && (!x_major || 2 * adv > du))
+    {
+        auto walk = [&](auto plot)
+        {
+            int v = v0 + v_step * k;
+            for (int64_t i = i_begin; i <= i_end; ++i)
+            {
+                const int u = u0 + i;
+                plot(x_major ? Vector2D<int>{u, v} : Vector2D<int>{v, u});
+                err += 2 * adv;
+                const bool step = err >= den;
+                err -= step ? den : 0;
+                v += step ? v_step : 0;
+            }
+        };
+        if (auto native = writer.Native())
+        {
+            const uint32_t pixel = native->ToNative(c);
+            walk([native, pixel](Vector2D<int> pos)
+                 { native->WriteNative(pos, pixel); });
+        }
+        else
+        {
+            walk([&writer, &c](Vector2D<int> pos)
+                 { writer.Write(pos, c); });
+        }
+        return;
+    }
+
+    int64_t run_begin = i_begin;
+    for (int64_t i = i_begin; i < i_end; ++i)
+    {
+        err += 2 * adv;
+        if (err >= den)
+        {
+            err -= den;
+            emit(run_begin, i + 1 - run_begin, k);
+            ++k;
+            run_begin = i + 1;
+        }
+    }
+    emit(run_begin, i_end + 1 - run_begin, k);
+}
+
+void DrawLineAntialiased(FrameBufferWriter &writer, Vector2D<int> p0, Vector2D<int> p1, const PixelColor &c)
+{
+    int x0 = p0.x, y0 = p0.y, x1 = p1.x, y1 = p1.y;
+    int64_t dx = static_cast<int64_t>(x1) - x0, dy = static_cast<int64_t>(y1) - y0;
+    if (std::max(std::abs(dx), std::abs(dy)) > kMaxLineLength)
+    {
+        const int xm = x0 + dx / 2, ym = y0 + dy / 2;
+        DrawLineAntialiased(writer, {x0, y0}, {xm, ym}, c);
+        DrawLineAntialiased(writer, {xm, ym}, {x1, y1}, c);
+        return;
+    }
+    const bool x_major = std::abs(dx) >= std::abs(dy);
+    if ((x_major ? dx : dy) < 0)
+    {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+        dx = -dx;
+        dy = -dy;
+    }
+
+    const int64_t u0 = x_major ? x0 : y0, v0 = x_major ? y0 : x0;
+    const int64_t du = x_major ? dx : dy;
+    const int64_t dv = x_major ? dy : dx;
+    const int64_t u_limit = x_major ? writer.Width() : writer.Height();
+    const int64_t v_limit = x_major ? writer.Height() : writer.Width();
+
+    auto plot = [&](int64_t u, int64_t v, int alpha)
     {
-        for (int dx = 0; dx < size.x; ++dx)
+        if (alpha == 0 || v < 0 || v_limit <= v)
+        {
+            return;
+        }
+        const Vector2D<int> pos = x_major ? Vector2D<int>{static_cast<int>(u), static_cast<int>(v)}
+                                          : Vector2D<int>{static_cast<int>(v), static_cast<int>(u)};
+        writer.Write(pos, Mix(c, writer.Read(pos), alpha));
+    };
+
+    const int64_t i_begin = std::max<int64_t>(0, -u0);
+    const int64_t i_end = std::min<int64_t>(du, u_limit - 1 - u0);
+
+    // The exact minor position in 1/256 pixel is |i * dv * 256 / du| with the sign of dv,
+    // which is stepped as a quotient and a remainder because the product overflows for long lines
+    const int64_t n = std::abs(dv) * 256;
+    const int64_t step_q = du == 0 ? 0 : n / du, step_r = du == 0 ? 0 : n % du;
+    int64_t q = du == 0 ? 0 : i_begin * step_q + i_begin * step_r / du;
+    int64_t r = du == 0 ? 0 : i_begin * step_r % du;
+    for (int64_t i = i_begin; i <= i_end; ++i)
+    {
+        const int64_t pos = dv < 0 ? -q : q;
+        const int64_t v = v0 + (pos >> 8);
+        const int frac = pos & 0xff;
+        plot(u0 + i, v, 256 - frac);
+        plot(u0 + i, v + 1, frac);
+
+        q += step_q;
+        r += step_r;
+        if (r >= du)
         {
-            writer.Write(pos + Vector2D<int>{dx, dy}, c);
+            ++q;
+            r -= du;
         }
     }
 }
@@ -98,15 +98,37 @@ Rectangle<T> operator&(const Rectangle<T> &lhs, const Rectangle<U> &rhs)
     return {new_pos, new_size};
 }
 
+/** @brief Store value to n 32-bit pixels */
+void FillPixels(uint32_t *dst, int n, uint32_t value);
+/** @brief Copy n 32-bit pixels, dst and src must not overlap */
+void CopyPixels(uint32_t *dst, const uint32_t *src, int n);
+/** @brief Copy n 32-bit pixels except those equal to key, which leave dst as is */
+void BlendPixels(uint32_t *dst, const uint32_t *src, int n, uint32_t key);
+
+class FrameBufferWriter;
+
 class PixelWriter
 {
 public:
     virtual ~PixelWriter() = default;
     virtual void Write(Vector2D<int> pos, const PixelColor &c) = 0;
+    /** @brief Write the color to len pixels from pos to the right, the span must be inside the writer */
+    virtual void FillSpan(Vector2D<int> pos, int len, const PixelColor &c);
     virtual int Width() const = 0;
     virtual int Height() const = 0;
+    /**
+     * @brief Get the frame buffer writer which has the same coordinates as this writer
+     *
+     * Drawing functions use it to write native pixels in spans, and fall back to Write() if it is nullptr.
+     */
+    virtual FrameBufferWriter *Native() { return nullptr; }
 };
 
+/**
+ * @brief Writer for a frame buffer of 32-bit pixels
+ *
+ * Spans are written as whole 32-bit pixels in the native format of the frame buffer.
+ */
 class FrameBufferWriter : public PixelWriter
 {
 public:
@@ -114,11 +136,38 @@ public:
     virtual ~FrameBufferWriter() = default;
     virtual int Width() const override { return config_.horizontal_resolution; }
     virtual int Height() const override { return config_.vertical_resolution; }
+    virtual FrameBufferWriter *Native() override { return this; }
+
+    virtual void FillSpan(Vector2D<int> pos, int len, const PixelColor &c) override
+    {
+        FillPixels(PixelAt(pos), len, ToNative(c));
+    }
+    /** @brief Write a native pixel to pos */
+    void WriteNative(Vector2D<int> pos, uint32_t pixel) { *PixelAt(pos) = pixel; }
+    /** @brief Copy len native pixels to pos */
+    void CopySpan(Vector2D<int> pos, const uint32_t *src, int len)
+    {
+        CopyPixels(PixelAt(pos), src, len);
+    }
+    /** @brief Copy len native pixels to pos except those equal to the native pixel key */
+    void BlendSpan(Vector2D<int> pos, const uint32_t *src, int len, uint32_t key)
+    {
+        BlendPixels(PixelAt(pos), src, len, key);
+    }
+
+    /** @brief Read the color of the pixel at pos */
+    PixelColor Read(Vector2D<int> pos) const { return FromNative(*PixelAt(pos)); }
+
+    /** @brief Convert a color to the native pixel of the frame buffer */
+    virtual uint32_t ToNative(const PixelColor &c) const = 0;
+    /** @brief Convert a native pixel of the frame buffer to a color */
+    virtual PixelColor FromNative(uint32_t pixel) const = 0;
 
 protected:
-    uint8_t *PixelAt(Vector2D<int> pos)
+    uint32_t *PixelAt(Vector2D<int> pos) const
     {
-        return config_.frame_buffer + 4 * (config_.pixels_per_scan_line * pos.y + pos.x);
+        return reinterpret_cast<uint32_t *>(config_.frame_buffer) +
+               config_.pixels_per_scan_line * pos.y + pos.x;
     }
 
 private:
@@ -130,6 +179,15 @@ class RGBResv8BitPerColorPixelWriter : public FrameBufferWriter
 public:
     using FrameBufferWriter::FrameBufferWriter;
     virtual void Write(Vector2D<int> pos, const PixelColor &c) override;
+    virtual uint32_t ToNative(const PixelColor &c) const override
+    {
+        return c.r | c.g << 8 | c.b << 16;
+    }
+    virtual PixelColor FromNative(uint32_t pixel) const override
+    {
+        return {static_cast<uint8_t>(pixel), static_cast<uint8_t>(pixel >> 8),
+                static_cast<uint8_t>(pixel >> 16)};
+    }
 };
 
 class BGRResv8BitPerColorPixelWriter : public FrameBufferWriter
@@ -138,6 +196,15 @@ public:
     using FrameBufferWriter::FrameBufferWriter;
 
     virtual void Write(Vector2D<int> pos, const PixelColor &c) override;
+    virtual uint32_t ToNative(const PixelColor &c) const override
+    {
+        return c.b | c.g << 8 | c.r << 16;
+    }
+    virtual PixelColor FromNative(uint32_t pixel) const override
+    {
+        return {static_cast<uint8_t>(pixel >> 16), static_cast<uint8_t>(pixel >> 8),
+                static_cast<uint8_t>(pixel)};
+    }
 };
 
 void DrawRectangle(PixelWriter &writer, const Vector2D<int> &pos,
@@ -146,6 +213,30 @@ void DrawRectangle(PixelWriter &writer, const Vector2D<int> &pos,
 void FillRectangle(PixelWriter &writer, const Vector2D<int> &pos,
                    const Vector2D<int> &size, const PixelColor &c);
 
+/**
+ * @brief Draw a line with the integer midpoint rule
+ *
+ * The line is walked along its major axis, and pixel i of it is offset on the minor axis by
+ * floor((2 * i * |d_minor| + d_major) / (2 * d_major)).
+ * The range of i whose pixels are in the writer is solved once from the formula,
+ * so no pixel is tested against the writer in the loop.
+ * Pixels sharing a minor coordinate are written as one rectangle,
+ * which is a single span for lines closer to horizontal.
+ *
+ * @param width Thickness of the line across the major axis
+ */
+void DrawLine(PixelWriter &writer, Vector2D<int> p0, Vector2D<int> p1, const PixelColor &c,
+              int width = 1);
+
+/**
+ * @brief Draw a line of width 1 with Xiaolin Wu's algorithm
+ *
+ * Each step of the major axis covers the two pixels around the exact position,
+ * and mixes the color into them in proportion to the coverage in 1/256.
+ */
+void DrawLineAntialiased(FrameBufferWriter &writer, Vector2D<int> p0, Vector2D<int> p1,
+                         const PixelColor &c);
+
 const PixelColor kDesktopBGColor{45, 118, 237};
 const PixelColor kDesktopFGColor{255, 255, 255};
 
@@ -55,6 +55,28 @@ constexpr InterruptDescriptorAttribute MakeIDTAttr(
 
 const int kISTForTimer = 1; // index of the interrupt stack table
 
+/**
+ * @brief Disable interrupts, return RFLAGS to be passed to RestoreInterrupts()
+ *
+ * Unlike a bare cli/sti pair, this can be nested and can be used before interrupts are enabled.
+ */
+inline uint64_t DisableInterrupts()
+{
+    uint64_t rflags;
+    __asm__ volatile("pushfq\n\tpop %0\n\tcli"
+                     : "=r"(rflags));
+    return rflags;
+}
+
+/** @brief Enable interrupts again if they were enabled before DisableInterrupts() */
+inline void RestoreInterrupts(uint64_t rflags)
+{
+    if (rflags & 0x200)
+    {
+        __asm__("sti");
+    }
+}
+
 void SetIDTEntry(
     InterruptDescriptor &desc,
     InterruptDescriptorAttribute attr,
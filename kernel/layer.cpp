@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include "console.hpp"
+#include "interrupt.hpp"
 #include "logger.hpp"
 #include "task.hpp"
 
@@ -13,6 +14,76 @@ namespace
         auto it = std::remove_if(c.begin(), c.end(), pred);
         c.erase(it, c.end());
     }
+
+    bool IsEmpty(const Rectangle<int> &r)
+    {
+        return r.size.x <= 0 || r.size.y <= 0;
+    }
+
+    int Area(const Rectangle<int> &r)
+    {
+        return r.size.x * r.size.y;
+    }
+
+    Rectangle<int> BoundingBox(const Rectangle<int> &a, const Rectangle<int> &b)
+    {
+        const auto pos = ElementMin(a.pos, b.pos);
+        return {pos, ElementMax(a.pos + a.size, b.pos + b.size) - pos};
+    }
+
+    /** @brief Append the parts of r which are not covered by hole, at most 4 rectangles */
+    void Subtract(const Rectangle<int> &r, const Rectangle<int> &hole,
+                  std::vector<Rectangle<int>> &out)
+    {
+        const auto inter = r & hole;
+        if (IsEmpty(inter))
+        {
+            out.push_back(r);
+            return;
+        }
+
+        const auto r_end = r.pos + r.size;
+        const auto inter_end = inter.pos + inter.size;
+        const Rectangle<int> parts[] = {
+            {r.pos, {r.size.x, inter.pos.y - r.pos.y}},
+            {{r.pos.x, inter_end.y}, {r.size.x, r_end.y - inter_end.y}},
+            {{r.pos.x, inter.pos.y}, {inter.pos.x - r.pos.x, inter.size.y}},
+            {{inter_end.x, inter.pos.y}, {r_end.x - inter_end.x, inter.size.y}},
+        };
+        for (const auto &part : parts)
+        {
+            if (!IsEmpty(part))
+            {
+                out.push_back(part);
+            }
+        }
+    }
+
+    /** @brief Merge rectangles whose bounding box is not larger than the sum of them */
+    void MergeRectangles(std::vector<Rectangle<int>> &rects)
+    {
+        bool merged = true;
+        while (merged)
+        {
+            merged = false;
+            for (size_t i = 0; i < rects.size(); ++i)
+            {
+                for (size_t j = i + 1; j < rects.size(); ++j)
+                {
+                    const auto box = BoundingBox(rects[i], rects[j]);
+                    if (Area(box) > Area(rects[i]) + Area(rects[j]))
+                    {
+                        continue;
+                    }
+                    rects[i] = box;
+                    rects[j] = rects.back();
+                    rects.pop_back();
+                    merged = true;
+                    --j;
+                }
+            }
+        }
+    }
 } // namespace
 Layer::Layer(unsigned int id) : id_{id} {}
 
@@ -94,43 +165,122 @@ void LayerManager::RemoveLayer(unsigned int id)
     EraseIf(layers_, pred);
 }
 
-void LayerManager::Draw(const Rectangle<int> &area) const
+void LayerManager::Draw(const Rectangle<int> &area)
+{
+    AddDamage(area);
+}
+
+void LayerManager::Draw(unsigned int id)
+{
+    Draw(id, {{0, 0}, {-1, -1}});
+}
+
+void LayerManager::Draw(unsigned int id, Rectangle<int> area)
 {
-    for (auto layer : layer_stack_)
+    auto it = std::find_if(layer_stack_.begin(), layer_stack_.end(),
+                           [id](Layer *layer)
+                           { return layer->ID() == id; });
+    if (it == layer_stack_.end())
     {
-        layer->DrawTo(back_buffer_, area);
+        return;
     }
-    screen_->Copy(area.pos, back_buffer_, area);
+
+    // Layers above are drawn by Compose() if they overlap the area
+    Rectangle<int> window_area{(*it)->GetPosition(), (*it)->GetWindow()->Size()};
+    if (area.size.x >= 0 || area.size.y >= 0)
+    {
+        area.pos = area.pos + window_area.pos;
+        window_area = window_area & area;
+    }
+    AddDamage(window_area);
 }
 
-void LayerManager::Draw(unsigned int id) const
+void LayerManager::Flush()
 {
-    Draw(id, {{0, 0}, {-1, -1}});
+    const auto rflags = DisableInterrupts();
+    flushing_.swap(damage_);
+    damage_.clear();
+    flush_requested_ = false;
+    for (Layer *layer : layer_stack_)
+    {
+        if (auto window = layer->GetWindow())
+        {
+            stack_snapshot_.push_back({std::move(window), layer->GetPosition()});
+        }
+    }
+    RestoreInterrupts(rflags);
+
+    MergeRectangles(flushing_);
+    for (const auto &area : flushing_)
+    {
+        Compose(area);
+    }
+    flushing_.clear();
+    stack_snapshot_.clear();
 }
 
-void LayerManager::Draw(unsigned int id, Rectangle<int> area) const
+void LayerManager::AddDamage(const Rectangle<int> &area)
 {
-    bool draw = false;
-    Rectangle<int> window_area;
-    for (auto layer : layer_stack_)
+    const auto clipped = area & Rectangle<int>{{0, 0}, ScreenSize()};
+    if (IsEmpty(clipped))
+    {
+        return;
+    }
+
+    if (task_manager == nullptr)
     {
-        if (layer->ID() == id)
+        // Nobody flushes before tasks start, render at once
+        damage_.push_back(clipped);
+        Flush();
+        return;
+    }
+
+    // Draw functions are called both with and without interrupts disabled
+    const auto rflags = DisableInterrupts();
+    damage_.push_back(clipped);
+    if (!flush_requested_)
+    {
+        flush_requested_ = true;
+        task_manager->Wakeup(1); // main task
+    }
+    RestoreInterrupts(rflags);
+}
+
+void LayerManager::Compose(const Rectangle<int> &area)
+{
+    // Walk the layers from the top, and cut the area by opaque layers
+    pieces_.clear();
+    region_.clear();
+    region_.push_back(area);
+    for (auto it = stack_snapshot_.rbegin(); it != stack_snapshot_.rend() && !region_.empty(); ++it)
+    {
+        const LayerSnapshot &layer = *it;
+        const Rectangle<int> layer_area{layer.pos, layer.window->Size()};
+        for (const auto &r : region_)
         {
-            window_area.size = layer->GetWindow()->Size();
-            window_area.pos = layer->GetPosition();
-            if (area.size.x >= 0 || area.size.y >= 0)
+            const auto piece = r & layer_area;
+            if (!IsEmpty(piece))
             {
-                area.pos = area.pos + window_area.pos;
-                window_area = window_area & area;
+                pieces_.push_back({&layer, piece});
             }
-            draw = true;
         }
-        if (draw)
+
+        if (layer.window->IsOpaque())
         {
-            layer->DrawTo(back_buffer_, window_area);
+            region_rest_.clear();
+            for (const auto &r : region_)
+            {
+                Subtract(r, layer_area, region_rest_);
+            }
+            region_.swap(region_rest_);
         }
     }
-    screen_->Copy(window_area.pos, back_buffer_, window_area);
+
+    for (auto it = pieces_.rbegin(); it != pieces_.rend(); ++it)
+    {
+        it->layer->window->DrawTo(back_buffer_, it->layer->pos, it->area);
+    }
+    screen_->Copy(area.pos, back_buffer_, area);
 }
 
 void LayerManager::Move(unsigned int id, Vector2D<int> new_pos)
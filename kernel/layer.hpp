@@ -13,6 +13,8 @@
 #include "graphics.hpp"
 #include "window.hpp"
 #include "message.hpp"
+#include "slab.hpp"
+#include "timer.hpp"
 
 /**
  * @brief Represents a graphical layer with a unique identifier.
@@ -20,7 +22,9 @@
  * Currently, this class only holds one window,
  * but it can be extended for the future
  */
-class Layer
+inline constexpr char kLayerSlabName[] = "Layer";
+
+class Layer : public SlabObject<Layer, kLayerSlabName>
 {
 public:
     /** @brief Constructs a Layer with a unique identifier. */
@@ -54,7 +58,14 @@ private:
     bool draggable_{false};
 };
 
-/** @brief Manages multiple Layers. */
+/**
+ * @brief Manages multiple Layers.
+ *
+ * Draw functions do not render immediately, they record the damaged area of the screen.
+ * Flush() merges the damage and composes each area from the layers top down,
+ * so that the parts of layers covered by opaque layers are never drawn.
+ * The main task flushes when it runs out of messages, and at least once per kFlushIntervalTicks.
+ */
 class LayerManager
 {
 public:
@@ -70,12 +81,15 @@ public:
     void RemoveLayer(unsigned int id);
 
     /** @brief Draws the current displayed layer */
-    void Draw(const Rectangle<int> &area) const;
+    void Draw(const Rectangle<int> &area);
     /** @brief Draws a specific layer within the given area. */
-    void Draw(unsigned int id, Rectangle<int> area) const;
+    void Draw(unsigned int id, Rectangle<int> area);
 
     /** @brief Draws a specific layer. */
-    void Draw(unsigned int id) const;
+    void Draw(unsigned int id);
+
+    /** @brief Renders the damaged areas to the screen */
+    void Flush();
 
     /** @brief Moves a layer to a new absolute position, then re-renders */
     void Move(unsigned int id, Vector2D<int> new_pos);
@@ -100,13 +114,42 @@ public:
     int GetHeight(unsigned int id);
 
 private:
+    /** @brief A stacked layer as it was when Flush() started */
+    struct LayerSnapshot
+    {
+        std::shared_ptr<Window> window;
+        Vector2D<int> pos;
+    };
+
+    struct LayerPiece
+    {
+        const LayerSnapshot *layer;
+        Rectangle<int> area;
+    };
+
     FrameBuffer *screen_{nullptr};
-    mutable FrameBuffer back_buffer_{};
+    FrameBuffer back_buffer_{};
     std::vector<std::unique_ptr<Layer>> layers_{};
     std::vector<Layer *> layer_stack_{};
     unsigned int latest_id_{0};
+
+    std::vector<Rectangle<int>> damage_{};
+    bool flush_requested_{false};
+    // Work buffers of Flush(), kept to avoid allocations on every frame
+    std::vector<Rectangle<int>> flushing_{}, region_{}, region_rest_{};
+    std::vector<LayerPiece> pieces_{};
+    /** @brief The stack from the bottom, taken under cli so that tasks may close layers while composing */
+    std::vector<LayerSnapshot> stack_snapshot_{};
+
+    /** @brief Record a damaged area, and wake up the main task to flush it */
+    void AddDamage(const Rectangle<int> &area);
+    /** @brief Draw the visible pieces of layers in the area, then copy it to the screen */
+    void Compose(const Rectangle<int> &area);
 };
 
+/** @brief Interval to flush layers while the main task is busy, about 60 frames per second */
+const int kFlushIntervalTicks = kTimerFreq / 60;
+
 extern LayerManager *layer_manager;
 
 class ActiveLayer
@@ -128,7 +128,8 @@ extern "C" void
 KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_ref,
                    const MemoryMap &memory_map_ref,
                    const acpi::RSDP &acpi_table,
-                   void *volume_image)
+                   void *volume_image,
+                   size_t volume_bytes)
 {
     MemoryMap memory_map{memory_map_ref};
 
@@ -144,7 +145,12 @@ KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_ref,
     InitializeTSS();
     InitializeInterrupt();
 
-    fat::Initialize(volume_image);
+    auto boot_volume = new RamDisk{volume_image, volume_bytes};
+    if (auto err = fat::Initialize(*boot_volume))
+    {
+        Log(kError, "failed to mount the boot volume: %s\n", err.Name());
+        exit(1);
+    }
     InitializeFont();
     InitializePCI();
 
@@ -176,6 +182,7 @@ KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_ref,
         .Wakeup();
 
     char str[128];
+    unsigned long flush_tick = 0;
 
     while (true)
     {
@@ -188,13 +195,29 @@ KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_ref,
         WriteString(*main_window->InnerWriter(), {20, 4}, str, {0, 0, 0});
         layer_manager->Draw(main_window_layer_id);
 
+        // Keep the screen updated while messages keep coming
+        if (tick - flush_tick >= kFlushIntervalTicks)
+        {
+            layer_manager->Flush();
+            flush_tick = tick;
+        }
+
         __asm__("cli");
         auto msg = main_task.ReceiveMessage();
         if (!msg)
         {
-            main_task.Sleep();
             __asm__("sti");
-            continue;
+            layer_manager->Flush();
+            flush_tick = tick;
+
+            __asm__("cli");
+            msg = main_task.ReceiveMessage();
+            if (!msg)
+            {
+                main_task.Sleep();
+                __asm__("sti");
+                continue;
+            }
         }
 
         __asm__("sti");
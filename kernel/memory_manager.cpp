@@ -1,57 +1,143 @@
 #include <stdint.h>
 #include "memory_manager.hpp"
 
-#include <bitset>
+#include <algorithm>
 #include "logger.hpp"
+#include "paging.hpp"
+
+namespace
+{
+    using MapLineType = BitmapMemoryManager::MapLineType;
+
+    /** @brief Mask of num_bits bits from bit_index in a bitmap line */
+    MapLineType LineMask(size_t bit_index, size_t num_bits)
+    {
+        const auto ones = num_bits >= BitmapMemoryManager::kBitsPerMapLine
+                              ? ~static_cast<MapLineType>(0)
+                              : (static_cast<MapLineType>(1) << num_bits) - 1;
+        return ones << bit_index;
+    }
+
+    /** @brief The smallest order whose block holds num_frames frames */
+    int CeilOrder(size_t num_frames)
+    {
+        int order = 0;
+        while ((static_cast<size_t>(1) << order) < num_frames)
+        {
+            ++order;
+        }
+        return order;
+    }
+}
 
 BitmapMemoryManager::BitmapMemoryManager()
-    : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID(kFrameCount)} {}
+    : alloc_map_{}, free_lists_{}, free_lists_ready_{false},
+      range_begin_{FrameID{0}}, range_end_{FrameID(kFrameCount)} {}
 
 WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames)
 {
-    size_t start_frame_id = range_begin_.ID();
-    while (true)
+    if (num_frames == 0 || num_frames > (static_cast<size_t>(1) << kMaxOrder))
     {
-        size_t i = 0;
-        for (; i < num_frames; ++i)
-        {
-            if (start_frame_id + i >= range_end_.ID())
-            {
-                return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
-            }
-            if (GetBit(FrameID{start_frame_id + i}))
-            {
-                // Already allocated the frame of "start_frame_id + i"
-                break;
-            }
-        }
-        if (i == num_frames)
-        {
-            // Found enough free frames for num_frames
-            MarkAllocated(FrameID{start_frame_id}, num_frames);
-            return {
-                FrameID{start_frame_id},
-                MAKE_ERROR(Error::kSuccess)};
-        }
-        // Search from the next frame again
-        start_frame_id += i + 1;
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    const int order = CeilOrder(num_frames);
+    int block_order = order;
+    while (block_order <= kMaxOrder && free_lists_[block_order] == nullptr)
+    {
+        ++block_order;
+    }
+    if (block_order > kMaxOrder)
+    {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    FreeBlock *block = free_lists_[block_order];
+    RemoveBlock(block);
+    const size_t start_frame_id = reinterpret_cast<uintptr_t>(block) / kBytesPerFrame;
+
+    // Split the block until it fits, upper halves go back to the free lists
+    while (block_order > order)
+    {
+        --block_order;
+        PushBlock(start_frame_id + (static_cast<size_t>(1) << block_order), block_order);
+    }
+
+    // Give back the tail of the block which is not requested
+    const size_t block_frames = static_cast<size_t>(1) << order;
+    SetBits(FrameID{start_frame_id}, block_frames, true);
+    if (block_frames > num_frames)
+    {
+        ReleaseRange(start_frame_id + num_frames, block_frames - num_frames);
     }
+
+    return {
+        FrameID{start_frame_id},
+        MAKE_ERROR(Error::kSuccess)};
 };
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames)
 {
-    for (size_t i = 0; i < num_frames; ++i)
+    if (!free_lists_ready_)
     {
-        SetBit(FrameID{start_frame.ID() + i}, false);
+        SetBits(start_frame, num_frames, false);
+        return MAKE_ERROR(Error::kSuccess);
     }
+    ReleaseRange(start_frame.ID(), num_frames);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames)
 {
-    for (size_t i = 0; i < num_frames; ++i)
+    if (!free_lists_ready_)
     {
-        SetBit(FrameID{start_frame.ID() + i}, true);
+        SetBits(start_frame, num_frames, true);
+        return;
+    }
+
+    // Frames out of the managed range are never in the free lists
+    const size_t end_frame_id = start_frame.ID() + num_frames;
+    const size_t begin = std::max(start_frame.ID(), range_begin_.ID());
+    const size_t end = std::max(begin, std::min(end_frame_id, range_end_.ID()));
+    SetBits(start_frame, begin - start_frame.ID(), true);
+    SetBits(FrameID{end}, end_frame_id - end, true);
+
+    // Carve the range out of the free blocks which overlap it
+    size_t frame_id = FindBit(begin, end, false);
+    while (frame_id < end)
+    {
+        // Every free frame in the range is the head of a free block or inside one.
+        // The head of the block which contains frame_id is found from the largest order.
+        int order = kMaxOrder;
+        size_t head = frame_id;
+        for (; order >= 0; --order)
+        {
+            head = frame_id & ~((static_cast<size_t>(1) << order) - 1);
+            if (InRange(head) && !GetBit(FrameID{head}) && BlockAt(head)->order == order)
+            {
+                break;
+            }
+        }
+        if (order < 0)
+        {
+            Log(kError, "free frame %lu is not in the free lists\n", frame_id);
+            SetBit(FrameID{frame_id}, true);
+            frame_id = FindBit(frame_id + 1, end, false);
+            continue;
+        }
+
+        const size_t block_end = head + (static_cast<size_t>(1) << order);
+        RemoveBlock(BlockAt(head));
+        SetBits(FrameID{head}, block_end - head, true);
+        if (head < begin)
+        {
+            ReleaseRange(head, begin - head);
+        }
+        if (block_end > end)
+        {
+            ReleaseRange(end, block_end - end);
+        }
+        frame_id = FindBit(block_end, end, false);
     }
 }
 
@@ -59,15 +145,32 @@ void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end)
 {
     range_begin_ = range_begin;
     range_end_ = range_end;
+
+    // Build the free lists from the free runs in ascending order.
+    // A run is marked allocated before it is released so that
+    // the merge in InsertBlock never sees frames which are not listed yet.
+    size_t frame_id = FindBit(range_begin_.ID(), range_end_.ID(), false);
+    while (frame_id < range_end_.ID())
+    {
+        const size_t run_end = FindBit(frame_id, range_end_.ID(), true);
+        SetBits(FrameID{frame_id}, run_end - frame_id, true);
+        ReleaseRange(frame_id, run_end - frame_id);
+        frame_id = FindBit(run_end, range_end_.ID(), false);
+    }
+    free_lists_ready_ = true;
 }
 
 MemoryStat BitmapMemoryManager::Stat() const
 {
     size_t sum = 0;
-    for (int i = range_begin_.ID() / kBitsPerMapLine;
-         i < range_end_.ID() / kBitsPerMapLine; ++i)
+    size_t frame_id = range_begin_.ID();
+    while (frame_id < range_end_.ID())
     {
-        sum += std::bitset<kBitsPerMapLine>(alloc_map_[i]).count();
+        const auto line_index = frame_id / kBitsPerMapLine;
+        const auto bit_index = frame_id % kBitsPerMapLine;
+        const size_t bits = std::min(kBitsPerMapLine - bit_index, range_end_.ID() - frame_id);
+        sum += __builtin_popcountl(alloc_map_[line_index] & LineMask(bit_index, bits));
+        frame_id += bits;
     }
     return {sum, range_end_.ID() - range_begin_.ID()};
 }
@@ -95,28 +198,294 @@ void BitmapMemoryManager::SetBit(FrameID frame, bool allocated)
     }
 }
 
+void BitmapMemoryManager::SetBits(FrameID start_frame, size_t num_frames, bool allocated)
+{
+    const size_t end_frame_id = start_frame.ID() + num_frames;
+    size_t frame_id = start_frame.ID();
+    while (frame_id < end_frame_id)
+    {
+        const auto line_index = frame_id / kBitsPerMapLine;
+        const auto bit_index = frame_id % kBitsPerMapLine;
+        const size_t bits = std::min(kBitsPerMapLine - bit_index, end_frame_id - frame_id);
+        if (allocated)
+        {
+            alloc_map_[line_index] |= LineMask(bit_index, bits);
+        }
+        else
+        {
+            alloc_map_[line_index] &= ~LineMask(bit_index, bits);
+        }
+        frame_id += bits;
+    }
+}
+
+size_t BitmapMemoryManager::FindBit(size_t begin, size_t end, bool allocated) const
+{
+    size_t frame_id = begin;
+    while (frame_id < end)
+    {
+        const auto line_index = frame_id / kBitsPerMapLine;
+        const auto bit_index = frame_id % kBitsPerMapLine;
+
+        // Bits in the state we are looking for become 1, a line with no such bit is skipped at once
+        MapLineType line = allocated ? alloc_map_[line_index] : ~alloc_map_[line_index];
+        line &= ~static_cast<MapLineType>(0) << bit_index;
+        if (line != 0)
+        {
+            return std::min(end, line_index * kBitsPerMapLine + __builtin_ctzl(line));
+        }
+        frame_id = (line_index + 1) * kBitsPerMapLine;
+    }
+    return end;
+}
+
+bool BitmapMemoryManager::InRange(size_t frame_id) const
+{
+    return range_begin_.ID() <= frame_id && frame_id < range_end_.ID();
+}
+
+BitmapMemoryManager::FreeBlock *BitmapMemoryManager::BlockAt(size_t frame_id) const
+{
+    return reinterpret_cast<FreeBlock *>(FrameID{frame_id}.Frame());
+}
+
+void BitmapMemoryManager::PushBlock(size_t frame_id, int order)
+{
+    FreeBlock *block = BlockAt(frame_id);
+    block->order = order;
+    block->prev = nullptr;
+    block->next = free_lists_[order];
+    if (block->next)
+    {
+        block->next->prev = block;
+    }
+    free_lists_[order] = block;
+}
+
+void BitmapMemoryManager::RemoveBlock(FreeBlock *block)
+{
+    if (block->prev)
+    {
+        block->prev->next = block->next;
+    }
+    else
+    {
+        free_lists_[block->order] = block->next;
+    }
+    if (block->next)
+    {
+        block->next->prev = block->prev;
+    }
+}
+
+void BitmapMemoryManager::InsertBlock(size_t frame_id, int order)
+{
+    while (order < kMaxOrder)
+    {
+        // A free buddy is always the head of a free block whose order is not larger than ours
+        const size_t buddy = frame_id ^ (static_cast<size_t>(1) << order);
+        if (!InRange(buddy) || GetBit(FrameID{buddy}) || BlockAt(buddy)->order != order)
+        {
+            break;
+        }
+        RemoveBlock(BlockAt(buddy));
+        frame_id = std::min(frame_id, buddy);
+        ++order;
+    }
+    PushBlock(frame_id, order);
+}
+
+void BitmapMemoryManager::ReleaseRange(size_t start_frame_id, size_t num_frames)
+{
+    // Frames out of the managed range are only cleared in the bitmap
+    const size_t end_frame_id = start_frame_id + num_frames;
+    const size_t begin = std::max(start_frame_id, range_begin_.ID());
+    const size_t end = std::max(begin, std::min(end_frame_id, range_end_.ID()));
+    SetBits(FrameID{start_frame_id}, begin - start_frame_id, false);
+    SetBits(FrameID{end}, end_frame_id - end, false);
+
+    size_t frame_id = begin;
+    while (frame_id < end)
+    {
+        // The largest aligned block starting at frame_id which fits in the range
+        int order = 0;
+        while (order < kMaxOrder &&
+               (frame_id & ((static_cast<size_t>(2) << order) - 1)) == 0 &&
+               frame_id + (static_cast<size_t>(2) << order) <= end)
+        {
+            ++order;
+        }
+
+        const size_t block_frames = static_cast<size_t>(1) << order;
+        SetBits(FrameID{frame_id}, block_frames, false);
+        InsertBlock(frame_id, order);
+        frame_id += block_frames;
+    }
+}
+
+FrameCache::FrameCache(BitmapMemoryManager &manager) : manager_{manager} {}
+
+WithError<FrameID> FrameCache::Allocate()
+{
+    if (num_frames_ > 0)
+    {
+        ++hits_;
+    }
+    else
+    {
+        ++misses_;
+        if (auto err = Refill())
+        {
+            return {kNullFrame, err};
+        }
+    }
+
+    --num_frames_;
+    return {FrameID{frames_[num_frames_]}, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error FrameCache::Free(FrameID frame)
+{
+    if (num_frames_ == kCapacity)
+    {
+        if (auto err = Drain())
+        {
+            return err;
+        }
+    }
+
+    frames_[num_frames_] = frame.ID();
+    ++num_frames_;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+FrameCacheStat FrameCache::Stat() const
+{
+    return {hits_, misses_, num_frames_};
+}
+
+Error FrameCache::Refill()
+{
+    // Take a contiguous batch if possible, fall back to single frames when memory is fragmented
+    if (auto [start, err] = manager_.Allocate(kBatchFrames); !err)
+    {
+        for (size_t i = 0; i < kBatchFrames; ++i)
+        {
+            frames_[num_frames_] = start.ID() + kBatchFrames - 1 - i;
+            ++num_frames_;
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    auto [frame, err] = manager_.Allocate(1);
+    if (err)
+    {
+        return err;
+    }
+    frames_[num_frames_] = frame.ID();
+    ++num_frames_;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error FrameCache::Drain()
+{
+    for (size_t i = 0; i < kBatchFrames; ++i)
+    {
+        --num_frames_;
+        if (auto err = manager_.Free(FrameID{frames_[num_frames_]}, 1))
+        {
+            return err;
+        }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
 extern "C" caddr_t program_break, program_break_end;
 
 namespace
 {
     char memory_manager_buf[sizeof(BitmapMemoryManager)];
+    char frame_cache_buf[sizeof(FrameCache)];
+
+    /** @brief The heap lives just above the identity mapping, below the PML4 entry 0 shared by all tasks */
+    const uintptr_t kHeapStart = kPageDirectoryCount * 1_GiB;
+    const size_t kHeapMaxBytes = 64_GiB;
+    /** @brief The heap is mapped and unmapped by this granularity */
+    const size_t kHeapChunkBytes = 1_MiB;
 
-    Error InitializeHeap(BitmapMemoryManager &memory_manager)
+    size_t heap_peak_bytes;
+
+    uintptr_t RoundUpToChunk(uintptr_t addr)
     {
-        const int kHeapFrames = 64 * 512;
-        const auto heap_start = memory_manager.Allocate(kHeapFrames);
-        if (heap_start.error)
+        return (addr + kHeapChunkBytes - 1) / kHeapChunkBytes * kHeapChunkBytes;
+    }
+
+    Error InitializeHeap()
+    {
+        program_break = reinterpret_cast<caddr_t>(kHeapStart);
+        program_break_end = program_break;
+        if (ExtendHeap(program_break + 1) != 0)
         {
-            return heap_start.error;
+            return MAKE_ERROR(Error::kNoEnoughMemory);
         }
-
-        program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-        program_break_end = program_break + kHeapFrames * kBytesPerFrame;
         return MAKE_ERROR(Error::kSuccess);
     }
 }
 
+extern "C" int ExtendHeap(caddr_t new_break)
+{
+    const auto end = reinterpret_cast<uintptr_t>(program_break_end);
+    const auto new_end = RoundUpToChunk(reinterpret_cast<uintptr_t>(new_break));
+    if (new_end <= end)
+    {
+        return 0;
+    }
+    if (new_end > kHeapStart + kHeapMaxBytes)
+    {
+        return -1;
+    }
+
+    const size_t num_pages = (new_end - end) / kBytesPerFrame;
+    if (auto err = SetupKernelPageMaps(LinearAddress4Level{end}, num_pages))
+    {
+        // Pages mapped before the failure are given back
+        CleanKernelPageMaps(LinearAddress4Level{end}, num_pages);
+        return -1;
+    }
+
+    program_break_end = reinterpret_cast<caddr_t>(new_end);
+    heap_peak_bytes = std::max(heap_peak_bytes, new_end - kHeapStart);
+    return 0;
+}
+
+extern "C" void ShrinkHeap()
+{
+    const auto end = reinterpret_cast<uintptr_t>(program_break_end);
+    // Keep one spare chunk above the break so that malloc trimming does not remap at once
+    const auto keep_end = RoundUpToChunk(reinterpret_cast<uintptr_t>(program_break)) + kHeapChunkBytes;
+    if (keep_end >= end)
+    {
+        return;
+    }
+
+    if (auto err = CleanKernelPageMaps(LinearAddress4Level{keep_end},
+                                       (end - keep_end) / kBytesPerFrame))
+    {
+        Log(kError, "failed to shrink heap: %s\n", err.Name());
+    }
+    program_break_end = reinterpret_cast<caddr_t>(keep_end);
+}
+
+HeapStat GetHeapStat()
+{
+    return {
+        static_cast<size_t>(program_break - reinterpret_cast<caddr_t>(kHeapStart)),
+        static_cast<size_t>(program_break_end - reinterpret_cast<caddr_t>(kHeapStart)),
+        heap_peak_bytes};
+}
+
 BitmapMemoryManager *memory_manager;
+FrameCache *frame_cache;
 
 void InitializeMemoryManager(const MemoryMap &memory_map)
 {
@@ -150,10 +519,13 @@ void InitializeMemoryManager(const MemoryMap &memory_map)
         }
     }
 
+    // Free list nodes are written into free frames, which must be reachable by the identity mapping
+    available_end = std::min<uintptr_t>(available_end, kPageDirectoryCount * 1_GiB);
     memory_manager->SetMemoryRange(FrameID{1},
                                    FrameID{available_end / kBytesPerFrame});
+    ::frame_cache = new (frame_cache_buf) FrameCache{*memory_manager};
 
-    if (auto err = InitializeHeap(*memory_manager))
+    if (auto err = InitializeHeap())
     {
         Log(kError, "failed to allocate pages: %s at %s:%d\n",
             err.Name(), err.File(), err.Line());
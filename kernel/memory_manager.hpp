@@ -8,6 +8,7 @@
 
 #include <array>
 #include <limits>
+#include <sys/types.h>
 
 #include "error.hpp"
 #include "memory_map.hpp"
@@ -61,6 +62,11 @@ static const FrameID kNullFrame{std::numeric_limits<size_t>::max()};
  * each alloc_map indexes correspond to a frame, 0 means free, 1 means using.
  * The physical address of m indexed bit in alloc_map[n] is calculated as:
  * kFrameBytes * (n * kBitesPerMapLine + m)
+ *
+ * Free frames are also kept in buddy free lists, one list per order.
+ * A block of order k is 2^k frames aligned to 2^k frames.
+ * The list node of a free block is written into the first frame of the block itself,
+ * so Allocate() and Free() do not scan the bitmap to find or merge blocks.
  */
 class BitmapMemoryManager
 {
@@ -75,6 +81,9 @@ public:
     /** @brief The bit count of a element in bitmap array = frame count */
     static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
 
+    /** @brief The largest buddy block order, a block of kMaxOrder is 2^kMaxOrder frames (1 GiB) */
+    static const int kMaxOrder{18};
+
     /** @brief Initialize the instance */
     BitmapMemoryManager();
 
@@ -84,7 +93,9 @@ public:
     void MarkAllocated(FrameID start_frame, size_t num_frames);
 
     /** @brief Set the manageable memory range
-     * After calling this method, memory allocation by Allocate() is possible on the range
+     * After calling this method, memory allocation by Allocate() is possible on the range.
+     * The free frames in the range are put into the buddy free lists here,
+     * so this method must be called after the frames reserved by the memory map are marked.
      *
      * @param range_begin The first frame ID of manageable memory range
      * @param range_end The last frame ID of manageable memory range, the next frame of the last frame
@@ -97,7 +108,18 @@ public:
     MemoryStat Stat() const;
 
 private:
+    /** @brief List node stored in the first frame of a free block */
+    struct FreeBlock
+    {
+        FreeBlock *prev, *next;
+        int order;
+    };
+
     std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+    /** @brief Head of free blocks for each order */
+    std::array<FreeBlock *, kMaxOrder + 1> free_lists_;
+    /** @brief True after SetMemoryRange() built the free lists */
+    bool free_lists_ready_;
 
     /** @brief The start of memory range */
     FrameID range_begin_;
@@ -106,7 +128,85 @@ private:
 
     bool GetBit(FrameID frame) const;
     void SetBit(FrameID frame, bool allocated);
+    /** @brief Set or clear the bits of a frame range by whole bitmap lines */
+    void SetBits(FrameID start_frame, size_t num_frames, bool allocated);
+    /** @brief Find the first frame in [begin, end) whose bit equals allocated, return end if none */
+    size_t FindBit(size_t begin, size_t end, bool allocated) const;
+
+    bool InRange(size_t frame_id) const;
+    FreeBlock *BlockAt(size_t frame_id) const;
+    void PushBlock(size_t frame_id, int order);
+    void RemoveBlock(FreeBlock *block);
+
+    /** @brief Put a block into the free list of the order, merging it with its free buddies */
+    void InsertBlock(size_t frame_id, int order);
+    /** @brief Split allocated frames into aligned blocks and put them into the free lists */
+    void ReleaseRange(size_t start_frame_id, size_t num_frames);
+};
+
+struct FrameCacheStat
+{
+    size_t hits;
+    size_t misses;
+    size_t cached_frames;
+};
+
+/** @brief Cache of single frames in front of BitmapMemoryManager
+ *
+ * Page tables and demand paged pages are allocated one frame at a time.
+ * This class keeps a magazine of such frames, so most of them are served without touching the bitmap.
+ * The magazine is refilled from and drained to the memory manager by kBatchFrames frames.
+ * The kernel runs on a single CPU, so there is one cache for the CPU.
+ * Frames held by the cache are counted as allocated in BitmapMemoryManager::Stat().
+ */
+class FrameCache
+{
+public:
+    /** @brief The number of frames the magazine can hold */
+    static const size_t kCapacity{64};
+    /** @brief The number of frames moved between the magazine and the memory manager at once */
+    static const size_t kBatchFrames{kCapacity / 2};
+
+    FrameCache(BitmapMemoryManager &manager);
+
+    /** @brief Acquire one frame */
+    WithError<FrameID> Allocate();
+    /** @brief Release one frame acquired by Allocate() or BitmapMemoryManager::Allocate(1) */
+    Error Free(FrameID frame);
+
+    FrameCacheStat Stat() const;
+
+private:
+    BitmapMemoryManager &manager_;
+    std::array<size_t, kCapacity> frames_{};
+    size_t num_frames_{0};
+    size_t hits_{0}, misses_{0};
+
+    Error Refill();
+    Error Drain();
 };
 
+struct HeapStat
+{
+    /** @brief Bytes below the program break */
+    size_t used_bytes;
+    /** @brief Bytes backed by frames */
+    size_t mapped_bytes;
+    /** @brief The high-water mark of mapped_bytes */
+    size_t peak_mapped_bytes;
+};
+
+/**
+ * @brief Map frames so that the kernel heap reaches new_break, return 0 on success
+ *
+ * sbrk() in newlib_support.c calls this when the program break goes beyond program_break_end.
+ * The heap is a virtual range mapped by chunks, so it is not limited by contiguous physical memory.
+ */
+extern "C" int ExtendHeap(caddr_t new_break);
+/** @brief Unmap whole chunks above the program break and free their frames */
+extern "C" void ShrinkHeap();
+HeapStat GetHeapStat();
+
 extern BitmapMemoryManager *memory_manager;
+extern FrameCache *frame_cache;
 void InitializeMemoryManager(const MemoryMap &memory_map);
\ No newline at end of file
@@ -20,7 +20,6 @@ struct Message
         kMouseMove,
         kMouseButton,
         kWindowActive,
-        kPipe,
         kWindowClose,
     } type;
 
@@ -69,12 +68,6 @@ struct Message
             int activate; // 1: activate, 0: deactivate
         } window_active;
 
-        struct
-        {
-            char data[16];
-            uint8_t len;
-        } pipe;
-
         struct
         {
             unsigned int layer_id;
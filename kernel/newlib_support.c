@@ -10,9 +10,13 @@ void _exit(void)
 
 caddr_t program_break, program_break_end;
 
+int ExtendHeap(caddr_t new_break);
+void ShrinkHeap(void);
+
 caddr_t sbrk(int incr)
 {
-    if (program_break == 0 || program_break + incr >= program_break_end)
+    if (program_break == 0 ||
+        (program_break + incr >= program_break_end && ExtendHeap(program_break + incr) != 0))
     {
         errno = ENOMEM;
         return (caddr_t)-1;
@@ -20,6 +24,10 @@ caddr_t sbrk(int incr)
 
     caddr_t prev_break = program_break;
     program_break += incr;
+    if (incr < 0)
+    {
+        ShrinkHeap();
+    }
     return prev_break;
 }
 
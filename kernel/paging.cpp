@@ -69,7 +69,7 @@ namespace
     WithError<size_t> SetupPageMap(
         PageMapEntry *page_map, int page_map_level,
         LinearAddress4Level addr,
-        size_t num_4kpages, bool writable)
+        size_t num_4kpages, bool writable, bool user)
     {
         while (num_4kpages > 0)
         {
@@ -80,7 +80,10 @@ namespace
             {
                 return {num_4kpages, err};
             }
-            page_map[entry_index].bits.user = 1;
+            if (user)
+            {
+                page_map[entry_index].bits.user = 1;
+            }
 
             if (page_map_level == 1)
             {
@@ -92,7 +95,7 @@ namespace
                 page_map[entry_index].bits.writable = true;
                 auto [num_remain_pages, err] =
                     SetupPageMap(child_map, page_map_level - 1,
-                                 addr, num_4kpages, writable);
+                                 addr, num_4kpages, writable, user);
                 if (err)
                 {
                     return {num_4kpages, err};
@@ -139,7 +142,7 @@ namespace
             {
                 const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
                 const FrameID map_frame{entry_addr / kBytesPerFrame};
-                if (auto err = memory_manager->Free(map_frame, 1))
+                if (auto err = frame_cache->Free(map_frame))
                 {
                     return err;
                 }
@@ -196,6 +199,22 @@ namespace
         return SetPageContent(table[i].Pointer(), part - 1, addr, content);
     }
 
+    /** @brief Find the 4 KiB page entry of addr, return nullptr if a table on the way is not present */
+    PageMapEntry *FindPageEntry(PageMapEntry *pml4, LinearAddress4Level addr)
+    {
+        PageMapEntry *table = pml4;
+        for (int level = 4; level > 1; --level)
+        {
+            const auto &entry = table[addr.Part(level)];
+            if (!entry.bits.present || entry.bits.huge_page)
+            {
+                return nullptr;
+            }
+            table = entry.Pointer();
+        }
+        return &table[addr.Part(1)];
+    }
+
     Error CopyOnePage(uint64_t causal_addr)
     {
         auto [p, err] = NewPageMap();
@@ -213,7 +232,7 @@ namespace
 
 WithError<PageMapEntry *> NewPageMap()
 {
-    auto frame = memory_manager->Allocate(1);
+    auto frame = frame_cache->Allocate();
     if (frame.error)
     {
         return {nullptr, frame.error};
@@ -227,13 +246,41 @@ WithError<PageMapEntry *> NewPageMap()
 Error FreePageMap(PageMapEntry *table)
 {
     const FrameID frame{reinterpret_cast<uintptr_t>(table) / kBytesPerFrame};
-    return memory_manager->Free(frame, 1);
+    return frame_cache->Free(frame);
 }
 
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable)
 {
     auto pml4_table = reinterpret_cast<PageMapEntry *>(GetCR3());
-    return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable).error;
+    return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable, true).error;
+}
+
+Error SetupKernelPageMaps(LinearAddress4Level addr, size_t num_4kpages)
+{
+    auto kernel_pml4 = reinterpret_cast<PageMapEntry *>(&pml4_table[0]);
+    return SetupPageMap(kernel_pml4, 4, addr, num_4kpages, true, false).error;
+}
+
+Error CleanKernelPageMaps(LinearAddress4Level addr, size_t num_4kpages)
+{
+    auto kernel_pml4 = reinterpret_cast<PageMapEntry *>(&pml4_table[0]);
+    for (size_t i = 0; i < num_4kpages; ++i, addr.value += kPageSize4K)
+    {
+        auto entry = FindPageEntry(kernel_pml4, addr);
+        if (entry == nullptr || !entry->bits.present)
+        {
+            continue;
+        }
+
+        const auto page_addr = reinterpret_cast<uintptr_t>(entry->Pointer());
+        if (auto err = frame_cache->Free(FrameID{page_addr / kBytesPerFrame}))
+        {
+            return err;
+        }
+        entry->data = 0;
+        InvalidateTLB(addr.value);
+    }
+    return MAKE_ERROR(Error::kSuccess);
 }
 
 Error CleanPageMaps(LinearAddress4Level addr)
@@ -242,6 +289,51 @@ Error CleanPageMaps(LinearAddress4Level addr)
     return CleanPageMap(pml4_table, 4, addr);
 }
 
+Error MapFrames(LinearAddress4Level addr, FrameID frame, size_t num_4kpages)
+{
+    auto pml4_table = reinterpret_cast<PageMapEntry *>(GetCR3());
+    auto page = reinterpret_cast<uintptr_t>(frame.Frame());
+    for (size_t i = 0; i < num_4kpages; ++i, addr.value += kPageSize4K, page += kPageSize4K)
+    {
+        PageMapEntry *table = pml4_table;
+        for (int level = 4; level > 1; --level)
+        {
+            auto &entry = table[addr.Part(level)];
+            auto [child_map, err] = setNewPageMapIfNotPresent(entry);
+            if (err)
+            {
+                return err;
+            }
+            entry.bits.writable = 1;
+            entry.bits.user = 1;
+            table = child_map;
+        }
+
+        auto &entry = table[addr.Part(1)];
+        entry.data = 0;
+        entry.SetPointer(reinterpret_cast<PageMapEntry *>(page));
+        entry.bits.present = 1;
+        entry.bits.writable = 1;
+        entry.bits.user = 1;
+        InvalidateTLB(addr.value);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapFrames(LinearAddress4Level addr, size_t num_4kpages)
+{
+    auto pml4_table = reinterpret_cast<PageMapEntry *>(GetCR3());
+    for (size_t i = 0; i < num_4kpages; ++i, addr.value += kPageSize4K)
+    {
+        if (auto entry = FindPageEntry(pml4_table, addr))
+        {
+            entry->data = 0;
+            InvalidateTLB(addr.value);
+        }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
 Error CopyPageMaps(PageMapEntry *dest, PageMapEntry *src, int part, int start)
 {
     if (part == 1)
@@ -8,6 +8,7 @@
 #include <cstdint>
 
 #include "error.hpp"
+#include "memory_manager.hpp"
 
 /**
  * @brief Number of page directories acquired statically
@@ -119,5 +120,25 @@ WithError<PageMapEntry *> NewPageMap();
 Error FreePageMap(PageMapEntry *table);
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable = true);
 Error CleanPageMaps(LinearAddress4Level addr);
+
+/**
+ * @brief Map pages for the kernel itself
+ *
+ * The pages are mapped in the kernel's PML4 table, and are not accessible from user mode.
+ * Use an address below the PML4 entry 0 so that the mapping is shared by all tasks,
+ * because each task copies the lower half of the kernel's PML4 table.
+ */
+Error SetupKernelPageMaps(LinearAddress4Level addr, size_t num_4kpages);
+/** @brief Unmap pages mapped by SetupKernelPageMaps and free their frames */
+Error CleanKernelPageMaps(LinearAddress4Level addr, size_t num_4kpages);
+/**
+ * @brief Map frames owned by the kernel into the user space of the current task
+ *
+ * The pages are writable from user mode and refer to num_4kpages frames from frame.
+ * Unmap them by UnmapFrames before CleanPageMaps, which would free the frames.
+ */
+Error MapFrames(LinearAddress4Level addr, FrameID frame, size_t num_4kpages);
+/** @brief Unmap pages mapped by MapFrames without freeing the frames */
+Error UnmapFrames(LinearAddress4Level addr, size_t num_4kpages);
 Error CopyPageMaps(PageMapEntry *dest, PageMapEntry *src, int part, int start);
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
\ No newline at end of file
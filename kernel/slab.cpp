@@ -0,0 +1,176 @@
+#include "slab.hpp"
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+namespace
+{
+    size_t RoundUp(size_t value, size_t align)
+    {
+        return (value + align - 1) / align * align;
+    }
+}
+
+SlabCache *slab_caches;
+
+void *SlabCache::Allocate()
+{
+    if (slab_frames_ == 0)
+    {
+        Setup();
+    }
+
+    if (partial_ == nullptr && NewSlab() == nullptr)
+    {
+        return nullptr;
+    }
+
+    Slab *slab = partial_;
+    FreeObject *obj = slab->free_objects;
+    slab->free_objects = obj->next;
+    if (slab->num_used == 0)
+    {
+        --num_empty_slabs_;
+    }
+    ++slab->num_used;
+    if (slab->free_objects == nullptr)
+    {
+        // Full slabs are not listed, Free() finds them by address
+        RemoveSlab(slab);
+    }
+
+    ++objects_in_use_;
+    ++num_allocations_;
+    return obj;
+}
+
+void SlabCache::Free(void *p)
+{
+    if (p == nullptr)
+    {
+        return;
+    }
+
+    Slab *slab = SlabOf(p);
+    if (slab->free_objects == nullptr)
+    {
+        PushSlab(slab);
+    }
+
+    auto obj = reinterpret_cast<FreeObject *>(p);
+    obj->next = slab->free_objects;
+    slab->free_objects = obj;
+    --slab->num_used;
+    --objects_in_use_;
+
+    if (slab->num_used > 0)
+    {
+        return;
+    }
+
+    if (num_empty_slabs_ == 0)
+    {
+        ++num_empty_slabs_;
+        return;
+    }
+
+    RemoveSlab(slab);
+    --num_slabs_;
+    const FrameID frame{reinterpret_cast<uintptr_t>(slab) / kBytesPerFrame};
+    if (auto err = memory_manager->Free(frame, slab_frames_))
+    {
+        Log(kError, "failed to free slab of %s: %s\n", name_, err.Name());
+    }
+}
+
+SlabStat SlabCache::Stat() const
+{
+    return {
+        object_size_,
+        num_slabs_,
+        objects_in_use_,
+        num_slabs_ * objects_per_slab_,
+        num_allocations_};
+}
+
+void SlabCache::Setup()
+{
+    if (align_ < alignof(FreeObject))
+    {
+        align_ = alignof(FreeObject);
+    }
+    stride_ = RoundUp(object_size_ < sizeof(FreeObject) ? sizeof(FreeObject) : object_size_,
+                      align_);
+    first_offset_ = RoundUp(sizeof(Slab), align_);
+
+    slab_frames_ = 1;
+    while ((slab_frames_ * kBytesPerFrame - first_offset_) / stride_ < kMinObjectsPerSlab)
+    {
+        slab_frames_ *= 2;
+    }
+    objects_per_slab_ = (slab_frames_ * kBytesPerFrame - first_offset_) / stride_;
+
+    next_ = slab_caches;
+    slab_caches = this;
+}
+
+SlabCache::Slab *SlabCache::NewSlab()
+{
+    auto [frame, err] = memory_manager->Allocate(slab_frames_);
+    if (err)
+    {
+        Log(kError, "failed to allocate slab of %s: %s\n", name_, err.Name());
+        return nullptr;
+    }
+
+    auto slab = reinterpret_cast<Slab *>(frame.Frame());
+    slab->num_used = 0;
+    slab->free_objects = nullptr;
+
+    // Chain objects from the last one so that they are handed out in address order
+    auto base = reinterpret_cast<uint8_t *>(slab) + first_offset_;
+    for (size_t i = objects_per_slab_; i > 0; --i)
+    {
+        auto obj = reinterpret_cast<FreeObject *>(base + (i - 1) * stride_);
+        obj->next = slab->free_objects;
+        slab->free_objects = obj;
+    }
+
+    PushSlab(slab);
+    ++num_slabs_;
+    ++num_empty_slabs_;
+    return slab;
+}
+
+SlabCache::Slab *SlabCache::SlabOf(void *p) const
+{
+    const uintptr_t slab_bytes = slab_frames_ * kBytesPerFrame;
+    return reinterpret_cast<Slab *>(reinterpret_cast<uintptr_t>(p) & ~(slab_bytes - 1));
+}
+
+void SlabCache::PushSlab(Slab *slab)
+{
+    slab->prev = nullptr;
+    slab->next = partial_;
+    if (partial_)
+    {
+        partial_->prev = slab;
+    }
+    partial_ = slab;
+}
+
+void SlabCache::RemoveSlab(Slab *slab)
+{
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        partial_ = slab->next;
+    }
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
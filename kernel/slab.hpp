@@ -0,0 +1,182 @@
+/**
+ * @file slab.hpp
+ *
+ * @brief Slab allocator for fixed-size kernel objects.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+struct SlabStat
+{
+    size_t object_size;
+    size_t num_slabs;
+    size_t objects_in_use;
+    size_t objects_capacity;
+    size_t num_allocations;
+};
+
+/**
+ * @brief Cache of objects of the same size
+ *
+ * Objects are carved from slabs of frames allocated by memory_manager.
+ * The number of frames per slab is a power of two, and the buddy allocator aligns such blocks,
+ * so the slab of an object is found by masking its address.
+ * Freed objects are reused in LIFO order, and one empty slab is kept to avoid refilling at once.
+ *
+ * The constructor is constexpr so that a cache can be a static variable without global constructors.
+ * The slab geometry is decided and the cache is registered to slab_caches on the first allocation.
+ */
+class SlabCache
+{
+public:
+    /** @brief The minimum number of objects in a slab */
+    static const size_t kMinObjectsPerSlab{8};
+
+    constexpr SlabCache(const char *name, size_t object_size, size_t align)
+        : name_{name}, object_size_{object_size}, align_{align} {}
+    SlabCache(const SlabCache &) = delete;
+    SlabCache &operator=(const SlabCache &) = delete;
+
+    /** @brief Allocate an uninitialized object, return nullptr if no memory is available */
+    void *Allocate();
+    /** @brief Return an object allocated by Allocate() */
+    void Free(void *p);
+
+    const char *Name() const { return name_; }
+    SlabStat Stat() const;
+    /** @brief Next cache in the list of slab_caches */
+    SlabCache *Next() const { return next_; }
+
+private:
+    struct FreeObject
+    {
+        FreeObject *next;
+    };
+
+    struct Slab
+    {
+        Slab *prev, *next;
+        FreeObject *free_objects;
+        size_t num_used;
+    };
+
+    const char *name_;
+    size_t object_size_;
+    size_t align_;
+
+    size_t stride_{0};
+    size_t first_offset_{0};
+    size_t slab_frames_{0};
+    size_t objects_per_slab_{0};
+
+    /** @brief Slabs which have at least one free object */
+    Slab *partial_{nullptr};
+    size_t num_slabs_{0};
+    size_t num_empty_slabs_{0};
+    size_t objects_in_use_{0};
+    size_t num_allocations_{0};
+    SlabCache *next_{nullptr};
+
+    void Setup();
+    Slab *NewSlab();
+    Slab *SlabOf(void *p) const;
+    void PushSlab(Slab *slab);
+    void RemoveSlab(Slab *slab);
+};
+
+/** @brief Head of the list of slab caches which have been used */
+extern SlabCache *slab_caches;
+
+/**
+ * @brief Allocator which takes objects of T from a SlabCache named Name
+ *
+ * This meets the requirements of Allocator, so it can be passed to std::allocate_shared.
+ * Each type rebound from this allocator has its own cache.
+ * Arrays are allocated by the global operator new.
+ */
+template <class T, const char *Name>
+class SlabAllocator
+{
+public:
+    using value_type = T;
+
+    template <class U>
+    struct rebind
+    {
+        using other = SlabAllocator<U, Name>;
+    };
+
+    SlabAllocator() = default;
+    template <class U>
+    SlabAllocator(const SlabAllocator<U, Name> &) {}
+
+    T *allocate(size_t n)
+    {
+        if (n != 1)
+        {
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T *>(Cache().Allocate());
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        if (n != 1)
+        {
+            ::operator delete(p);
+            return;
+        }
+        Cache().Free(p);
+    }
+
+    static SlabCache &Cache()
+    {
+        static SlabCache cache{Name, sizeof(T), alignof(T)};
+        return cache;
+    }
+};
+
+template <class T, class U, const char *Name>
+bool operator==(const SlabAllocator<T, Name> &, const SlabAllocator<U, Name> &)
+{
+    return true;
+}
+
+template <class T, class U, const char *Name>
+bool operator!=(const SlabAllocator<T, Name> &, const SlabAllocator<U, Name> &)
+{
+    return false;
+}
+
+/**
+ * @brief Base class which makes new and delete of T use a SlabCache named Name
+ *
+ * Objects of a class derived from T have another size and go to the global operator new.
+ */
+template <class T, const char *Name>
+class SlabObject
+{
+public:
+    static void *operator new(size_t size)
+    {
+        if (size != sizeof(T))
+        {
+            return ::operator new(size);
+        }
+        return SlabAllocator<T, Name>::Cache().Allocate();
+    }
+
+    static void operator delete(void *p, size_t size)
+    {
+        if (size != sizeof(T))
+        {
+            ::operator delete(p);
+            return;
+        }
+        SlabAllocator<T, Name>::Cache().Free(p);
+    }
+};
@@ -1,9 +1,10 @@
 #include "syscall.hpp"
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <cerrno>
-#include <cmath>
+#include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
 
@@ -16,6 +17,8 @@
 #include "timer.hpp"
 #include "keyboard.hpp"
 #include "app_event.hpp"
+#include "draw_command.hpp"
+#include "window_surface.hpp"
 
 namespace syscall
 {
@@ -74,26 +77,82 @@ namespace syscall
         return {task.OSStackPointer(), static_cast<int>(arg1)};
     }
 
+    namespace
+    {
+        unsigned int AddWindowLayer(std::shared_ptr<ToplevelWindow> win, int x, int y)
+        {
+            __asm__("cli");
+            const auto layer_id = layer_manager->NewLayer()
+                                      .SetWindow(win)
+                                      .SetDraggable(true)
+                                      .Move({x, y})
+                                      .ID();
+            active_layer->Activate(layer_id);
+
+            const auto task_id = task_manager->CurrentTask().ID();
+            layer_task_map->insert(std::make_pair(layer_id, task_id));
+            __asm__("sti");
+            return layer_id;
+        }
+    }
+
     SYSCALL(OpenWindow)
     {
         const int w = arg1, h = arg2, x = arg3, y = arg4;
         const auto title = reinterpret_cast<const char *>(arg5);
-        const auto win = std::make_shared<ToplevelWindow>(
-            w, h, screen_config.pixel_format, title);
+        const auto win = std::allocate_shared<ToplevelWindow>(
+            ToplevelWindowAllocator{}, w, h, screen_config.pixel_format, title);
+
+        return {AddWindowLayer(win, x, y), 0};
+    }
+
+    SYSCALL(OpenWindowSurface)
+    {
+        const int w = arg1, h = arg2, x = arg3, y = arg4;
+        const auto title = reinterpret_cast<const char *>(arg5);
+        if (arg6 < 0x8000'0000'0000'0000)
+        {
+            return {0, EFAULT};
+        }
+        const auto surface = reinterpret_cast<WindowSurface *>(arg6);
+        if (w <= 0 || h <= 0)
+        {
+            return {0, EINVAL};
+        }
+
+        const auto win = std::allocate_shared<ToplevelWindow>(
+            ToplevelWindowAllocator{}, w, h, screen_config.pixel_format, title, true);
+        if (win->SurfaceFrames() == 0)
+        {
+            return {0, ENOMEM};
+        }
 
         __asm__("cli");
-        const auto layer_id = layer_manager->NewLayer()
-                                  .SetWindow(win)
-                                  .SetDraggable(true)
-                                  .Move({x, y})
-                                  .ID();
-        active_layer->Activate(layer_id);
-
-        const auto task_id = task_manager->CurrentTask().ID();
-        layer_task_map->insert(std::make_pair(layer_id, task_id));
+        auto &task = task_manager->CurrentTask();
         __asm__("sti");
 
-        return {layer_id, 0};
+        // Pixels are placed below the files mapped by MapFile
+        const uint64_t vaddr_end = task.FileMapEnd();
+        const uint64_t vaddr_begin = vaddr_end - win->SurfaceFrames() * kBytesPerFrame;
+        if (auto err = MapFrames(LinearAddress4Level{vaddr_begin},
+                                 win->SurfaceFrame(), win->SurfaceFrames()))
+        {
+            UnmapFrames(LinearAddress4Level{vaddr_begin}, win->SurfaceFrames());
+            return {0, ENOMEM};
+        }
+        task.SetFileMapEnd(vaddr_begin);
+        task.SurfaceMaps().push_back(SurfaceMapping{win, vaddr_begin, vaddr_end});
+
+        const auto &config = win->SurfaceConfig();
+        surface->pixels = reinterpret_cast<uint32_t *>(vaddr_begin);
+        surface->width = w;
+        surface->height = h;
+        surface->pixels_per_scan_line = config.pixels_per_scan_line;
+        surface->format = config.pixel_format == kPixelRGBResv8BitPerColor
+                              ? WindowSurface::kRGB
+                              : WindowSurface::kBGR;
+
+        return {AddWindowLayer(win, x, y), 0};
     }
 
     namespace
@@ -167,64 +226,121 @@ namespace syscall
             arg1);
     }
 
+    SYSCALL(WinRedrawArea)
+    {
+        const unsigned int layer_id = arg1 & 0xffff'ffff;
+        const int x = arg2, y = arg3, w = arg4, h = arg5;
+        if (w <= 0 || h <= 0)
+        {
+            return {0, EINVAL};
+        }
+
+        __asm__("cli");
+        auto layer = layer_manager->FindLayer(layer_id);
+        if (layer)
+        {
+            layer_manager->Draw(layer_id, {{x, y}, {w, h}});
+        }
+        __asm__("sti");
+        if (layer == nullptr)
+        {
+            return {0, EBADF};
+        }
+        return {0, 0};
+    }
+
     SYSCALL(WinDrawLine)
     {
+        // Bit 1 of the flags asks for antialiasing, bits 8-15 give the width
+        const uint32_t layer_flags = arg1 >> 32;
+        const bool antialias = layer_flags & 2;
+        const int width = std::max<int>((layer_flags >> 8) & 0xff, 1);
         return DoWinFunc(
-            [](Window &win,
-               int x0, int y0, int x1, int y1, uint32_t color)
+            [antialias, width](Window &win,
+                               int x0, int y0, int x1, int y1, uint32_t color)
             {
-                auto sign = [](int x)
-                {
-                    return (x > 0) ? 1 : (x < 0) ? -1
-                                                 : 0;
-                };
-                const int dx = x1 - x0 + sign(x1 - x0);
-                const int dy = y1 - y0 + sign(y1 - y0);
-
-                if (dx == 0 && dy == 0)
+                if (antialias && width == 1)
                 {
-                    win.Writer()->Write({x0, y0}, ToColor(color));
-                    return Result{0, 0};
-                }
-
-                const auto floord = static_cast<double (*)(double)>(floor);
-                const auto ceild = static_cast<double (*)(double)>(ceil);
-
-                if (abs(dx) >= abs(dy))
-                {
-                    if (dx < 0)
-                    {
-                        std::swap(x0, x1);
-                        std::swap(y0, y1);
-                    }
-                    const auto roudish = y1 >= y0 ? floord : ceild;
-                    const double m = static_cast<double>(dy) / dx;
-                    for (int x = x0; x <= x1; ++x)
-                    {
-                        const int y = roudish(m * (x - x0) + y0);
-                        win.Writer()->Write({x, y}, ToColor(color));
-                    }
+                    DrawLineAntialiased(*win.Writer()->Native(), {x0, y0}, {x1, y1}, ToColor(color));
                 }
                 else
                 {
-                    if (dy < 0)
-                    {
-                        std::swap(x0, x1);
-                        std::swap(y0, y1);
-                    }
-                    const auto roundish = x1 >= x0 ? floord : ceild;
-                    const double m = static_cast<double>(dx) / dy;
-                    for (int y = y0; y <= y1; ++y)
-                    {
-                        const int x = roundish(m * (y - y0) + x0);
-                        win.Writer()->Write({x, y}, ToColor(color));
-                    }
+                    DrawLine(*win.Writer(), {x0, y0}, {x1, y1}, ToColor(color), width);
                 }
                 return Result{0, 0};
             },
             arg1, arg2, arg3, arg4, arg5, arg6);
     }
 
+    SYSCALL(WinDrawCommands)
+    {
+        const uint32_t layer_flags = arg1 >> 32;
+        const unsigned int layer_id = arg1 & 0xffff'ffff;
+        if (arg2 < 0x8000'0000'0000'0000)
+        {
+            return {0, EFAULT};
+        }
+        const auto commands = reinterpret_cast<const DrawCommand *>(arg2);
+        const size_t len = arg3;
+
+        __asm__("cli");
+        auto layer = layer_manager->FindLayer(layer_id);
+        __asm__("sti");
+        if (layer == nullptr)
+        {
+            return {0, EBADF};
+        }
+        Window &win = *layer->GetWindow();
+
+        // Bounding box of the drawn area in the window
+        Vector2D<int> damage_begin{win.Width(), win.Height()}, damage_end{0, 0};
+        auto add_damage = [&](Vector2D<int> begin, Vector2D<int> end)
+        {
+            damage_begin = ElementMin(damage_begin, begin);
+            damage_end = ElementMax(damage_end, end);
+        };
+
+        size_t i = 0;
+        int error = 0;
+        for (; i < len; ++i)
+        {
+            const auto &cmd = commands[i];
+            if (cmd.type == DrawCommand::kFillRectangle)
+            {
+                const auto &a = cmd.arg.rect;
+                FillRectangle(*win.Writer(), {a.x, a.y}, {a.w, a.h}, ToColor(cmd.color));
+                add_damage({a.x, a.y}, {a.x + a.w, a.y + a.h});
+            }
+            else if (cmd.type == DrawCommand::kDrawLine)
+            {
+                const auto &a = cmd.arg.line;
+                DrawLine(*win.Writer(), {a.x0, a.y0}, {a.x1, a.y1}, ToColor(cmd.color));
+                add_damage({std::min(a.x0, a.x1), std::min(a.y0, a.y1)},
+                           {std::max(a.x0, a.x1) + 1, std::max(a.y0, a.y1) + 1});
+            }
+            else if (cmd.type == DrawCommand::kWriteString)
+            {
+                const auto &a = cmd.arg.string;
+                WriteString(*win.Writer(), {a.x, a.y}, a.s, ToColor(cmd.color));
+                // No character is wider than 8 pixels per byte
+                add_damage({a.x, a.y}, {a.x + 8 * static_cast<int>(strlen(a.s)), a.y + 16});
+            }
+            else
+            {
+                error = EINVAL;
+                break;
+            }
+        }
+
+        if ((layer_flags & 1) == 0 && damage_begin.x < damage_end.x && damage_begin.y < damage_end.y)
+        {
+            __asm__("cli");
+            layer_manager->Draw(layer_id, {damage_begin, damage_end - damage_begin});
+            __asm__("sti");
+        }
+        return {i, error};
+    }
+
     SYSCALL(CloseWindow)
     {
         const unsigned int layer_id = arg1 & 0xffffffff;
@@ -248,6 +364,7 @@ namespace syscall
         __asm__("cli");
         auto &task = task_manager->CurrentTask();
         __asm__("sti");
+        task.FlushFiles();
         size_t i = 0;
 
         while (i < len)
@@ -359,6 +476,45 @@ namespace syscall
         return {timeout * 1000 / kTimerFreq, 0};
     }
 
+    SYSCALL(SetTimer)
+    {
+        const uint64_t timer_id = arg1;
+        const unsigned int mode = arg2;
+        const int timer_value = arg3;
+        if (timer_value <= 0)
+        {
+            return {0, EINVAL};
+        }
+
+        __asm__("cli");
+        const uint64_t task_id = task_manager->CurrentTask().ID();
+        uint64_t deadline = arg4;
+        if (mode & 1) // relative
+        {
+            deadline += timer_manager->Now();
+        }
+        auto [id, err] = timer_manager->SetTimer(timer_id, deadline, -timer_value, task_id);
+        __asm__("sti");
+        if (err)
+        {
+            return {0, ENOENT};
+        }
+        return {id, 0};
+    }
+
+    SYSCALL(CancelTimer)
+    {
+        __asm__("cli");
+        const uint64_t task_id = task_manager->CurrentTask().ID();
+        auto err = timer_manager->CancelTimer(arg1, task_id);
+        __asm__("sti");
+        if (err)
+        {
+            return {0, ENOENT};
+        }
+        return {0, 0};
+    }
+
     namespace
     {
         size_t AllocateFD(Task &task)
@@ -425,7 +581,8 @@ namespace syscall
         }
 
         size_t fd = AllocateFD(task);
-        task.Files()[fd] = std::make_unique<fat::FileDescriptor>(*file);
+        task.Files()[fd] = std::allocate_shared<fat::FileDescriptor>(
+            fat::FileDescriptorAllocator{}, *file);
         return {fd, 0};
     }
 
@@ -486,7 +643,7 @@ namespace syscall
 
 using SyscallFuncType = syscall::Result(uint64_t, uint64_t, uint64_t,
                                         uint64_t, uint64_t, uint64_t);
-extern "C" std::array<SyscallFuncType *, 0x10> syscall_table{
+extern "C" std::array<SyscallFuncType *, 0x15> syscall_table{
     /* 0x00 */ syscall::LogString,
     /* 0x01 */ syscall::PutString,
     /* 0x02 */ syscall::Exit,
@@ -503,6 +660,11 @@ extern "C" std::array<SyscallFuncType *, 0x10> syscall_table{
     /* 0x0d */ syscall::ReadFile,
     /* 0x0e */ syscall::DemandPages,
     /* 0x0f */ syscall::MapFile,
+    /* 0x10 */ syscall::SetTimer,
+    /* 0x11 */ syscall::CancelTimer,
+    /* 0x12 */ syscall::WinDrawCommands,
+    /* 0x13 */ syscall::OpenWindowSurface,
+    /* 0x14 */ syscall::WinRedrawArea,
 };
 
 void InitializeSyscall()
@@ -1,21 +1,9 @@
 #include "task.hpp"
 
-#include <algorithm>
-
 #include "asmfunc.h"
 #include "segment.hpp"
 #include "timer.hpp"
 
-namespace
-{
-    template <class T, class U>
-    void Erase(T &c, const U &value)
-    {
-        auto it = std::remove(c.begin(), c.end(), value);
-        c.erase(it, c.end());
-    }
-}
-
 void TaskIdle(uint64_t task_id, int64_t data)
 {
     while (true)
@@ -136,24 +124,71 @@ std::vector<FileMapping> &Task::FileMaps()
     return file_maps_;
 }
 
+std::vector<SurfaceMapping> &Task::SurfaceMaps()
+{
+    return surface_maps_;
+}
+
+void Task::FlushFiles()
+{
+    for (auto &file : files_)
+    {
+        if (file)
+        {
+            file->Flush();
+        }
+    }
+}
+
 TaskManager::TaskManager()
 {
+    task_slots_.emplace_back();
+
     Task &task = NewTask()
                      .SetLevel(current_level_)
                      .SetRunning(true);
-    running_[current_level_].push_back(&task);
+    running_.PushBack(&task);
 
     Task &idle = NewTask()
                      .InitContext(TaskIdle, 0)
                      .SetLevel(0)
                      .SetRunning(true);
-    running_[0].push_back(&idle);
+    running_.PushBack(&idle);
 }
 
 Task &TaskManager::NewTask()
 {
-    ++latest_id_;
-    return *tasks_.emplace_back(new Task{latest_id_});
+    size_t slot;
+    if (free_slots_.empty())
+    {
+        slot = task_slots_.size();
+        task_slots_.emplace_back();
+    }
+    else
+    {
+        slot = free_slots_.back();
+        free_slots_.pop_back();
+    }
+
+    auto &entry = task_slots_[slot];
+    entry.task.reset(new Task{(entry.generation << kSlotBits) | slot});
+    return *entry.task;
+}
+
+Task *TaskManager::FindTask(uint64_t id)
+{
+    const size_t slot = SlotOf(id);
+    if (slot >= task_slots_.size())
+    {
+        return nullptr;
+    }
+
+    Task *task = task_slots_[slot].task.get();
+    if (task == nullptr || task->ID() != id)
+    {
+        return nullptr;
+    }
+    return task;
 }
 
 void TaskManager::SwitchTask(const TaskContext &current_ctx)
@@ -176,26 +211,25 @@ void TaskManager::Sleep(Task *task)
 
     task->SetRunning(false);
 
-    if (task == running_[current_level_].front())
+    if (task == running_.Front(current_level_))
     {
         Task *current_task = RotateCurrentRunQueue(true);
         SwitchContext(&CurrentTask().Context(), &current_task->Context());
         return;
     }
 
-    Erase(running_[task->Level()], task);
+    running_.Remove(task);
 }
 
 Error TaskManager::Sleep(uint64_t id)
 {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto &t)
-                           { return t->ID() == id; });
-    if (it == tasks_.end())
+    Task *task = FindTask(id);
+    if (task == nullptr)
     {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    Sleep(it->get());
+    Sleep(task);
     return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -204,54 +238,57 @@ void TaskManager::Wakeup(Task *task, int level)
     if (task->Running())
     {
         ChangeLevelRunning(task, level);
-        return;
     }
-
-    if (level < 0)
+    else
     {
-        level = task->Level();
-    }
+        if (level < 0)
+        {
+            level = task->Level();
+        }
 
-    task->SetLevel(level);
-    task->SetRunning(true);
+        task->SetLevel(level);
+        task->SetRunning(true);
 
-    running_[level].push_back(task);
-    if (level > current_level_)
-    {
-        level_changed_ = true;
+        running_.PushBack(task);
     }
-    return;
+
+    // The task may have to preempt the current one
+    timer_manager->RearmInterrupt();
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level)
 {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto &t)
-                           { return t->ID() == id; });
-    if (it == tasks_.end())
+    Task *task = FindTask(id);
+    if (task == nullptr)
     {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    Wakeup(it->get(), level);
+    Wakeup(task, level);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message &msg)
 {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto &t)
-                           { return t->ID() == id; });
-    if (it == tasks_.end())
+    Task *task = FindTask(id);
+    if (task == nullptr)
     {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    (*it)->SendMessage(msg);
+    task->SendMessage(msg);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 Task &TaskManager::CurrentTask()
 {
-    return *running_[current_level_].front();
+    return *running_.Front(current_level_);
+}
+
+bool TaskManager::NeedsPreemption() const
+{
+    return running_.HighestLevel() > current_level_ ||
+           running_.Front(current_level_) != running_.Back(current_level_);
 }
 
 void TaskManager::Finish(int exit_code)
@@ -259,11 +296,10 @@ void TaskManager::Finish(int exit_code)
     Task *current_task = RotateCurrentRunQueue(true);
 
     const auto task_id = current_task->ID();
-    auto it = std::find_if(
-        tasks_.begin(), tasks_.end(),
-        [current_task](const auto &t)
-        { return t.get() == current_task; });
-    tasks_.erase(it);
+    const size_t slot = SlotOf(task_id);
+    task_slots_[slot].task.reset();
+    ++task_slots_[slot].generation;
+    free_slots_.push_back(slot);
 
     finish_tasks_[task_id] = exit_code;
     if (auto it = finish_waiter_.find(task_id); it != finish_waiter_.end())
@@ -301,66 +337,117 @@ void TaskManager::ChangeLevelRunning(Task *task, int level)
         return;
     }
 
-    if (task != running_[current_level_].front())
+    // Test before Remove(), which makes the next task the front of the current level
+    const bool is_current = task == running_.Front(current_level_);
+    running_.Remove(task);
+    task->SetLevel(level);
+    if (!is_current)
     {
         // change level of other task
-        Erase(running_[task->Level()], task);
-        running_[level].push_back(task);
-        task->SetLevel(level);
-        if (level > current_level_)
-        {
-            level_changed_ = true;
-        }
+        running_.PushBack(task);
         return;
     }
 
-    // change level myself
-    running_[current_level_].pop_front();
-    running_[level].push_front(task);
-    task->SetLevel(level);
-    if (level >= current_level_)
+    // change level myself, the task keeps running until the next switch
+    running_.PushFront(task);
+    current_level_ = level;
+}
+
+Task *TaskManager::RotateCurrentRunQueue(bool current_sleep)
+{
+    Task *current_task = running_.Front(current_level_);
+    running_.Remove(current_task);
+    if (!current_sleep)
+    {
+        running_.PushBack(current_task);
+    }
+
+    // The idle task is always running, so some level has a task
+    current_level_ = running_.HighestLevel();
+    // Tasks of the new level may have to share the CPU
+    timer_manager->RearmInterrupt();
+    return current_task;
+}
+
+void RunQueue::PushBack(Task *task)
+{
+    const int level = task->Level();
+    task->run_prev_ = tails_[level];
+    task->run_next_ = nullptr;
+    if (tails_[level])
     {
-        current_level_ = level;
+        tails_[level]->run_next_ = task;
     }
     else
     {
-        current_level_ = level;
-        level_changed_ = true;
+        heads_[level] = task;
+        level_bitmap_ |= uint64_t{1} << level;
     }
+    tails_[level] = task;
 }
 
-Task *TaskManager::RotateCurrentRunQueue(bool current_sleep)
+void RunQueue::PushFront(Task *task)
 {
-    auto &level_queue = running_[current_level_];
-    Task *current_task = level_queue.front();
-    level_queue.pop_front();
-    if (!current_sleep)
+    const int level = task->Level();
+    task->run_prev_ = nullptr;
+    task->run_next_ = heads_[level];
+    if (heads_[level])
     {
-        level_queue.push_back(current_task);
+        heads_[level]->run_prev_ = task;
     }
-    if (level_queue.empty())
+    else
     {
-        level_changed_ = true;
+        tails_[level] = task;
+        level_bitmap_ |= uint64_t{1} << level;
     }
+    heads_[level] = task;
+}
 
-    if (level_changed_)
+void RunQueue::Remove(Task *task)
+{
+    const int level = task->Level();
+    if (task->run_prev_)
     {
-        level_changed_ = false;
-        for (int lv = kMaxLevel; lv >= 0; --lv)
-        {
-            if (!running_[lv].empty())
-            {
-                current_level_ = lv;
-                break;
-            }
-        }
+        task->run_prev_->run_next_ = task->run_next_;
+    }
+    else
+    {
+        heads_[level] = task->run_next_;
     }
+    if (task->run_next_)
+    {
+        task->run_next_->run_prev_ = task->run_prev_;
+    }
+    else
+    {
+        tails_[level] = task->run_prev_;
+    }
+    task->run_prev_ = task->run_next_ = nullptr;
 
-    return current_task;
+    if (heads_[level] == nullptr)
+    {
+        level_bitmap_ &= ~(uint64_t{1} << level);
+    }
 }
 
 TaskManager *task_manager;
 
+void WaitQueue::Wait()
+{
+    Task &task = task_manager->CurrentTask();
+    tasks_.push_back(&task);
+    task.Sleep();
+}
+
+void WaitQueue::WakeupAll()
+{
+    for (Task *task : tasks_)
+    {
+        task->Wakeup();
+    }
+    tasks_.clear();
+}
+
 void InitializeTask()
 {
     task_manager = new TaskManager;
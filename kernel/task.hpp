@@ -19,6 +19,7 @@
 #include "message.hpp"
 #include "paging.hpp"
 #include "fat.hpp"
+#include "slab.hpp"
 
 struct TaskContext
 {
@@ -32,6 +33,8 @@ struct TaskContext
 using TaskFunc = void(uint64_t, int64_t);
 
 class TaskManager;
+class RunQueue;
+class Window;
 
 struct FileMapping
 {
@@ -39,7 +42,16 @@ struct FileMapping
     uint64_t vaddr_begin, vaddr_end;
 };
 
-class Task
+/** @brief Pixels of a window mapped into the application, which keep the window alive */
+struct SurfaceMapping
+{
+    std::shared_ptr<Window> window;
+    uint64_t vaddr_begin, vaddr_end;
+};
+
+inline constexpr char kTaskSlabName[] = "Task";
+
+class Task : public SlabObject<Task, kTaskSlabName>
 {
 public:
     static const int kDefaultLevel = 1;
@@ -62,6 +74,9 @@ public:
     uint64_t FileMapEnd() const;
     void SetFileMapEnd(uint64_t v);
     std::vector<FileMapping> &FileMaps();
+    std::vector<SurfaceMapping> &SurfaceMaps();
+    /** @brief Flush all the files, so that buffered output is shown before the task blocks */
+    void FlushFiles();
 
     int Level() const { return level_; }
     bool Running() const { return running_; }
@@ -78,6 +93,8 @@ private:
     uint64_t dpaging_begin_{0}, dpaging_end_{0};
     uint64_t file_map_end_{0};
     std::vector<FileMapping> file_maps_{};
+    std::vector<SurfaceMapping> surface_maps_{};
+    Task *run_prev_{nullptr}, *run_next_{nullptr};
 
     Task &SetLevel(int level)
     {
@@ -91,6 +108,34 @@ private:
     }
 
     friend TaskManager;
+    friend RunQueue;
+};
+
+/**
+ * @brief Queues of running tasks, one for each level
+ *
+ * Tasks are linked through their own pointers, and a bitmap records which levels have tasks.
+ * Every operation takes constant time regardless of the number of tasks and levels.
+ * A task is queued at Task::Level(), so change the level only while the task is not queued.
+ */
+class RunQueue
+{
+public:
+    static const int kMaxLevels = 64;
+
+    bool Empty(int level) const { return heads_[level] == nullptr; }
+    Task *Front(int level) const { return heads_[level]; }
+    Task *Back(int level) const { return tails_[level]; }
+    /** @brief The highest level which has a task, or -1 if all queues are empty */
+    int HighestLevel() const { return level_bitmap_ == 0 ? -1 : 63 - __builtin_clzl(level_bitmap_); }
+
+    void PushBack(Task *task);
+    void PushFront(Task *task);
+    void Remove(Task *task);
+
+private:
+    std::array<Task *, kMaxLevels> heads_{}, tails_{};
+    uint64_t level_bitmap_{0};
 };
 
 class TaskManager
@@ -98,6 +143,7 @@ class TaskManager
 public:
     // lavel: 0 = lowest, kMaxLevel = highest
     static const int kMaxLevel = 3;
+    static_assert(kMaxLevel < RunQueue::kMaxLevels);
 
     TaskManager();
     Task &NewTask();
@@ -109,22 +155,60 @@ public:
     Error Wakeup(uint64_t id, int level = -1);
     Error SendMessage(uint64_t id, const Message &msg);
     Task &CurrentTask();
+    /** @brief Whether another task waits for the CPU, that is, the task timer has to preempt */
+    bool NeedsPreemption() const;
     void Finish(int exit_code);
     WithError<int> WaitFinish(uint64_t task_id);
 
 private:
-    std::vector<std::unique_ptr<Task>> tasks_{};
-    uint64_t latest_id_{0};
-    std::array<std::deque<Task *>, kMaxLevel + 1> running_{};
+    /**
+     * @brief An entry of the task table
+     *
+     * A task ID is made of the index of its slot in the lower kSlotBits bits and
+     * the generation of the slot in the upper bits.
+     * The generation is incremented when the task finishes,
+     * so an ID of a finished task never matches a task which reuses the slot.
+     */
+    struct TaskSlot
+    {
+        std::unique_ptr<Task> task;
+        uint64_t generation;
+    };
+    static const int kSlotBits = 32;
+    static size_t SlotOf(uint64_t id) { return id & ((uint64_t{1} << kSlotBits) - 1); }
+
+    /** @brief Slot 0 is never used so that no task has ID 0 */
+    std::vector<TaskSlot> task_slots_{};
+    std::vector<size_t> free_slots_{};
+    RunQueue running_{};
     int current_level_{kMaxLevel};
-    bool level_changed_{false};
     std::map<uint64_t, int> finish_tasks_{};     // key: ID of a finished task
     std::map<uint64_t, Task *> finish_waiter_{}; // key: ID of a finished task
 
+    /** @brief Return the task of the ID, or nullptr if the task does not exist */
+    Task *FindTask(uint64_t id);
     void ChangeLevelRunning(Task *task, int level);
     Task *RotateCurrentRunQueue(bool current_sleep);
 };
 
 extern TaskManager *task_manager;
 
+/**
+ * @brief Tasks which sleep until a condition changes
+ *
+ * Check the condition and call Wait() with interrupts disabled so that no wakeup is lost,
+ * then check the condition again after Wait() returns.
+ */
+class WaitQueue
+{
+public:
+    /** @brief Sleep the current task until WakeupAll() is called */
+    void Wait();
+    /** @brief Wake up all the waiting tasks */
+    void WakeupAll();
+
+private:
+    std::vector<Task *> tasks_{};
+};
+
 void InitializeTask();
\ No newline at end of file
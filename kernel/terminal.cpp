@@ -1,5 +1,7 @@
 #include "terminal.hpp"
 
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <limits>
 
@@ -13,6 +15,7 @@
 #include "timer.hpp"
 #include "keyboard.hpp"
 #include "logger.hpp"
+#include "interrupt.hpp"
 
 namespace
 {
@@ -227,6 +230,10 @@ namespace
         while (dir_cluster != fat::kEndOfClusterchain)
         {
             auto dir = fat::GetSectorByCluster<fat::DirectoryEntry>(dir_cluster);
+            if (dir == nullptr)
+            {
+                return;
+            }
 
             for (int i = 0; i < kEntriesPerCluster; ++i)
             {
@@ -336,6 +343,69 @@ namespace
         }
         return FindCommand(command, apps_entry.first->FirstCluster());
     }
+
+    /** @brief Task which flushes the output of a terminal on timers, until a timer of value 0 comes */
+    void TaskOutputFlusher(uint64_t task_id, int64_t data)
+    {
+        auto terminal = reinterpret_cast<Terminal *>(data);
+        Task &task = task_manager->CurrentTask();
+        while (true)
+        {
+            __asm__("cli");
+            auto msg = task.ReceiveMessage();
+            if (!msg)
+            {
+                task.Sleep();
+                __asm__("sti");
+                continue;
+            }
+            if (msg->type == Message::kTimerTimeout && msg->arg.timer.value == 0)
+            {
+                task_manager->Finish(0);
+            }
+            __asm__("sti");
+
+            if (msg->type == Message::kTimerTimeout)
+            {
+                terminal->FlushOutputByTimer();
+            }
+        }
+    }
+
+    /** @brief Task of the pipebench command, which reads the pipe until it is closed */
+    void TaskPipeReader(uint64_t task_id, int64_t data)
+    {
+        auto pipe = reinterpret_cast<Pipe *>(data);
+        std::array<char, 4096> buf;
+        while (pipe->Read(buf.data(), buf.size()) > 0)
+        {
+        }
+
+        __asm__("cli");
+        task_manager->Finish(0);
+    }
+
+    /** @brief Task of the taskbench command, which takes messages until one of value 0 comes */
+    void TaskBenchWorker(uint64_t task_id, int64_t data)
+    {
+        Task &task = task_manager->CurrentTask();
+        while (true)
+        {
+            __asm__("cli");
+            auto msg = task.ReceiveMessage();
+            if (!msg)
+            {
+                task.Sleep();
+                __asm__("sti");
+                continue;
+            }
+            if (msg->arg.timer.value == 0)
+            {
+                task_manager->Finish(0);
+            }
+            __asm__("sti");
+        }
+    }
 } // namespace
 
 std::map<fat::DirectoryEntry *, AppLoadInfo> *app_loads;
@@ -362,12 +432,14 @@ Terminal::Terminal(Task &task, const TerminalDescriptor *term_desc)
 
     if (show_window_)
     {
-        window_ = std::make_shared<ToplevelWindow>(
+        window_ = std::allocate_shared<ToplevelWindow>(
+            ToplevelWindowAllocator{},
             kColumns * 8 + 8 + ToplevelWindow::kMarginX,
             kRows * 16 + 8 + ToplevelWindow::kMarginY,
             screen_config.pixel_format,
             "MikanTerm");
         DrawTerminal(*window_->InnerWriter(), {0, 0}, window_->InnerSize());
+        lines_.resize(kScrollbackRows, Line{});
 
         layer_id_ = layer_manager
                         ->NewLayer()
@@ -376,21 +448,29 @@ Terminal::Terminal(Task &task, const TerminalDescriptor *term_desc)
                         .ID();
 
         Print(">");
+
+        flusher_id_ = task_manager->NewTask()
+                          .InitContext(TaskOutputFlusher, reinterpret_cast<int64_t>(this))
+                          .Wakeup()
+                          .ID();
     }
     cmd_history_.resize(8);
 }
 
 Rectangle<int> Terminal::BlinkCursor()
 {
+    LockPrint();
     cursor_visible_ = !cursor_visible_;
     DrawCursor(cursor_visible_);
+    const auto pos = CalcCursorPos();
+    UnlockPrint();
 
-    return {CalcCursorPos(), {7, 15}};
+    return {pos, {7, 15}};
 }
 
 void Terminal::DrawCursor(bool visible)
 {
-    if (show_window_)
+    if (show_window_ && view_back_ == 0)
     {
         const auto color = visible ? ToColor(0xffffff) : ToColor(0);
         FillRectangle(*window_->Writer(), CalcCursorPos(), {7, 15}, color);
@@ -406,10 +486,24 @@ Vector2D<int> Terminal::CalcCursorPos() const
 Rectangle<int> Terminal::InputKey(
     uint8_t modifier, uint8_t keycode, char ascii)
 {
+    LockPrint();
     DrawCursor(false);
 
     Rectangle<int> draw_area{CalcCursorPos(), {8 * 2, 16}};
 
+    if (keycode == 0x4b || keycode == 0x4e) // page up, page down
+    {
+        ScrollView(keycode == 0x4b ? kRows / 2 : -kRows / 2);
+        Present();
+        DrawCursor(true);
+        UnlockPrint();
+        return {ToplevelWindow::kTopLeftMargin, window_->InnerSize()};
+    }
+    if (view_back_ > 0)
+    {
+        ScrollView(-view_back_);
+    }
+
     if (ascii == '\n')
     {
         linebuf_[linebuf_index_] = 0;
@@ -421,16 +515,15 @@ Rectangle<int> Terminal::InputKey(
         linebuf_index_ = 0;
         cmd_history_index_ = -1;
 
-        cursor_.x = 0;
-        if (cursor_.y < kRows - 1)
-        {
-            ++cursor_.y;
-        }
-        else
+        NewLine();
+        // Tasks of the command print to this terminal while it runs
+        UnlockPrint();
+        ExecuteLine();
+        for (auto &file : files_)
         {
-            Scroll1();
+            file->Flush();
         }
-        ExecuteLine();
+        LockPrint();
         Print(">");
         draw_area.pos = ToplevelWindow::kTopLeftMargin;
         draw_area.size = window_->InnerSize();
@@ -440,10 +533,7 @@ Rectangle<int> Terminal::InputKey(
         if (cursor_.x > 0)
         {
             --cursor_.x;
-            if (show_window_)
-            {
-                FillRectangle(*window_->Writer(), CalcCursorPos(), {8, 16}, {0, 0, 0});
-            }
+            SetCell(cursor_.x, 0);
             draw_area.pos = CalcCursorPos();
 
             if (linebuf_index_ > 0)
@@ -458,10 +548,7 @@ Rectangle<int> Terminal::InputKey(
         {
             linebuf_[linebuf_index_] = ascii;
             ++linebuf_index_;
-            if (show_window_)
-            {
-                WriteAscii(*window_->Writer(), CalcCursorPos(), ascii, {255, 255, 255});
-            }
+            SetCell(cursor_.x, ascii);
             ++cursor_.x;
         }
     }
@@ -474,19 +561,184 @@ Rectangle<int> Terminal::InputKey(
         draw_area = HistoryUpDown(1); // up arrow
     }
 
+    if (show_window_)
+    {
+        const auto presented = Present();
+        if (presented.size.x > 0)
+        {
+            const auto begin = ElementMin(draw_area.pos, presented.pos);
+            const auto end = ElementMax(draw_area.pos + draw_area.size,
+                                        presented.pos + presented.size);
+            draw_area = {begin, end - begin};
+        }
+    }
     DrawCursor(true);
+    UnlockPrint();
 
     return draw_area;
 };
 
-void Terminal::Scroll1()
+int Terminal::MaxViewBack() const
+{
+    return std::min<uint64_t>(top_line_, kScrollbackRows - kRows);
+}
+
+void Terminal::SetCell(int x, char32_t c)
+{
+    if (!show_window_)
+    {
+        return;
+    }
+
+    // Do not leave a half of a full-width character
+    auto &line = ScreenLine(cursor_.y);
+    if (line[x] == kWideTail && x > 0)
+    {
+        line[x - 1] = 0;
+    }
+    else if (line[x] != 0 && !IsHankaku(line[x]) && x + 1 < kColumns)
+    {
+        line[x + 1] = 0;
+    }
+    line[x] = c;
+    dirty_rows_.set(cursor_.y);
+}
+
+void Terminal::NewLine()
+{
+    cursor_.x = 0;
+    if (cursor_.y < kRows - 1)
+    {
+        ++cursor_.y;
+        return;
+    }
+    if (!show_window_)
+    {
+        return;
+    }
+
+    ++top_line_;
+    ScreenLine(kRows - 1).fill(0);
+    dirty_rows_ >>= 1;
+    dirty_rows_.set(kRows - 1);
+    ++pending_scroll_;
+
+    if (view_back_ > 0)
+    {
+        // Keep showing the same lines while they are in the history
+        const int back = std::min(view_back_ + 1, MaxViewBack());
+        view_moved_ |= back != view_back_ + 1;
+        view_back_ = back;
+    }
+}
+
+void Terminal::ScrollView(int lines)
+{
+    const int back = std::max(0, std::min(view_back_ + lines, MaxViewBack()));
+    if (back == view_back_)
+    {
+        return;
+    }
+    if (back == 0)
+    {
+        full_redraw_ = true;
+    }
+    view_back_ = back;
+    view_moved_ = true;
+}
+
+void Terminal::DrawRow(int row, const Line &line)
+{
+    const auto pos = ToplevelWindow::kTopLeftMargin + Vector2D<int>{4, 4 + 16 * row};
+    std::array<char, kColumns + 1> ascii;
+    int x = 0;
+    while (x < kColumns)
+    {
+        // Half-width cells in a row are written as one string
+        const int first = x;
+        int n = 0;
+        while (x < kColumns && (IsHankaku(line[x]) || line[x] == kWideTail))
+        {
+            ascii[n++] = IsHankaku(line[x]) && line[x] != 0 ? line[x] : ' ';
+            ++x;
+        }
+        if (n > 0)
+        {
+            ascii[n] = 0;
+            WriteString(*window_->Writer(), pos + Vector2D<int>{8 * first, 0}, ascii.data(),
+                        {255, 255, 255}, {0, 0, 0});
+            continue;
+        }
+
+        const Vector2D<int> char_pos = pos + Vector2D<int>{8 * x, 0};
+        FillRectangle(*window_->Writer(), char_pos, {x + 1 < kColumns ? 16 : 8, 16}, {0, 0, 0});
+        WriteUnicode(*window_->Writer(), char_pos, line[x], {255, 255, 255});
+        x += 2;
+    }
+}
+
+Rectangle<int> Terminal::Present()
 {
-    Rectangle<int> move_src{
-        ToplevelWindow::kTopLeftMargin + Vector2D<int>{4, 4 + 16},
-        {8 * kColumns, 16 * (kRows - 1)}};
-    window_->Move(ToplevelWindow::kTopLeftMargin + Vector2D<int>{4, 4}, move_src);
-    FillRectangle(*window_->InnerWriter(),
-                  {4, 4 + 16 * cursor_.y}, {8 * kColumns, 16}, {0, 0, 0});
+    const auto origin = ToplevelWindow::kTopLeftMargin + Vector2D<int>{4, 4};
+    const Rectangle<int> text_area{origin, {8 * kColumns, 16 * kRows}};
+    if (!show_window_)
+    {
+        return {origin, {0, 0}};
+    }
+
+    if (view_back_ > 0)
+    {
+        // The screen is drawn when the view comes back to it
+        if (!view_moved_)
+        {
+            return {origin, {0, 0}};
+        }
+        for (int row = 0; row < kRows; ++row)
+        {
+            DrawRow(row, LineAt(top_line_ - view_back_ + row));
+        }
+        view_moved_ = false;
+        full_redraw_ = true;
+        return text_area;
+    }
+
+    const bool scrolled = full_redraw_ || pending_scroll_ > 0;
+    if (full_redraw_ || pending_scroll_ >= kRows)
+    {
+        dirty_rows_.set();
+    }
+    else if (pending_scroll_ > 0)
+    {
+        Rectangle<int> move_src{
+            origin + Vector2D<int>{0, 16 * pending_scroll_},
+            {8 * kColumns, 16 * (kRows - pending_scroll_)}};
+        window_->Move(origin, move_src);
+    }
+    full_redraw_ = false;
+    view_moved_ = false;
+    pending_scroll_ = 0;
+
+    int first = kRows, last = -1;
+    for (int row = 0; row < kRows; ++row)
+    {
+        if (dirty_rows_[row])
+        {
+            DrawRow(row, ScreenLine(row));
+            first = std::min(first, row);
+            last = row;
+        }
+    }
+    dirty_rows_.reset();
+
+    if (scrolled)
+    {
+        return text_area;
+    }
+    if (last < 0)
+    {
+        return {origin, {0, 0}};
+    }
+    return {origin + Vector2D<int>{0, 16 * first}, {8 * kColumns, 16 * (last - first + 1)}};
 }
 
 void Terminal::ExecuteLine()
@@ -505,7 +757,7 @@ void Terminal::ExecuteLine()
         } while (isspace(*first_arg));
     }
 
-    auto original_stdout = files_[0];
+    auto original_stdout = files_[1];
     int exit_code = 0;
 
     if (redir_char)
@@ -536,36 +788,64 @@ void Terminal::ExecuteLine()
                       "cannot redirect to a directory: %s\n");
             return;
         }
-        files_[1] = std::make_shared<fat::FileDescriptor>(*file);
+        files_[1] = std::allocate_shared<fat::FileDescriptor>(
+            fat::FileDescriptorAllocator{}, *file);
     }
 
-    std::shared_ptr<PipeDescriptor> pipe_fd;
-    uint64_t subtask_id = 0;
+    std::shared_ptr<PipeDescriptor> pipe_writer;
+    std::vector<uint64_t> stage_ids;
 
     if (pipe_char)
     {
-        *pipe_char = 0;
-        char *subcommand = &pipe_char[1];
-        while (isspace(*subcommand))
+        // Split the rest of the line into the commands of the later stages
+        std::vector<char *> stage_commands;
+        while (pipe_char)
         {
-            ++subcommand;
+            *pipe_char = 0;
+            for (char *p = pipe_char - 1; p >= &linebuf_[0] && isspace(*p); --p)
+            {
+                *p = 0;
+            }
+            char *stage_command = &pipe_char[1];
+            while (isspace(*stage_command))
+            {
+                ++stage_command;
+            }
+            stage_commands.push_back(stage_command);
+            pipe_char = strchr(stage_command, '|');
         }
 
-        auto &subtask = task_manager->NewTask();
-        pipe_fd = std::make_shared<PipeDescriptor>(subtask);
-        auto term_desc = new TerminalDescriptor{
-            subcommand,
-            true,
-            false,
-            {pipe_fd, files_[1], files_[2]}};
-        files_[1] = pipe_fd;
+        // Every later stage runs on its own task, reading the pipe from the previous stage
+        auto pipe = std::make_shared<Pipe>();
+        pipe_writer = std::make_shared<PipeDescriptor>(pipe, true);
+        for (size_t i = 0; i < stage_commands.size(); ++i)
+        {
+            auto stage_stdin = std::make_shared<PipeDescriptor>(pipe, false);
+            std::shared_ptr<FileDescriptor> stage_stdout = files_[1];
+            if (i + 1 < stage_commands.size())
+            {
+                pipe = std::make_shared<Pipe>();
+                stage_stdout = std::make_shared<PipeDescriptor>(pipe, true);
+            }
+
+            auto term_desc = new TerminalDescriptor{
+                stage_commands[i],
+                true,
+                false,
+                {stage_stdin, stage_stdout, files_[2]}};
+            auto &subtask = task_manager->NewTask();
+            stage_ids.push_back(subtask
+                                    .InitContext(TaskTerminal,
+                                                 reinterpret_cast<int64_t>(term_desc))
+                                    .Wakeup()
+                                    .ID());
+        }
+        files_[1] = pipe_writer;
 
-        subtask_id = subtask
-                         .InitContext(TaskTerminal,
-                                      reinterpret_cast<int64_t>(term_desc))
-                         .Wakeup()
-                         .ID();
-        (*layer_task_map)[layer_id_] = subtask_id;
+        // Keys go to the last stage, which is the one usually reading them
+        __asm__("cli");
+        (*layer_task_map)[layer_id_] = stage_ids.back();
+        __asm__("sti");
     }
 
     if (strcmp(command, "echo") == 0)
@@ -585,12 +865,17 @@ void Terminal::ExecuteLine()
     }
     else if (strcmp(command, "clear") == 0)
     {
+        LockPrint();
         if (show_window_)
         {
-            FillRectangle(*window_->InnerWriter(),
-                          {4, 4}, {8 * kColumns, 16 * kRows}, {0, 0, 0});
+            for (int row = 0; row < kRows; ++row)
+            {
+                ScreenLine(row).fill(0);
+            }
+            full_redraw_ = true;
         }
         cursor_.y = 0;
+        UnlockPrint();
     }
     else if (strcmp(command, "lspci") == 0)
     {
@@ -609,7 +894,7 @@ void Terminal::ExecuteLine()
     {
         if (!first_arg || first_arg[0] == '\0')
         {
-            ListAllEntries(*files_[1], fat::boot_volume_image->root_cluster);
+            ListAllEntries(*files_[1], fat::boot_volume_bpb.root_cluster);
         }
         else
         {
@@ -663,7 +948,8 @@ void Terminal::ExecuteLine()
             }
             else
             {
-                fd = std::make_shared<fat::FileDescriptor>(*file_entry);
+                fd = std::allocate_shared<fat::FileDescriptor>(
+                    fat::FileDescriptorAllocator{}, *file_entry);
             }
         }
 
@@ -702,6 +988,124 @@ void Terminal::ExecuteLine()
         PrintToFD(*files_[1], "Phys total: %lu frames (%llu MiB)\n",
                   p_stat.total_frames,
                   p_stat.total_frames * kBytesPerFrame / 1024 / 1024);
+
+        const auto h_stat = GetHeapStat();
+        PrintToFD(*files_[1], "Heap: used %lu KiB, mapped %lu KiB, peak %lu KiB\n",
+                  h_stat.used_bytes / 1024, h_stat.mapped_bytes / 1024,
+                  h_stat.peak_mapped_bytes / 1024);
+
+        const auto c_stat = frame_cache->Stat();
+        PrintToFD(*files_[1], "Frame cache: %lu hits, %lu misses, %lu cached\n",
+                  c_stat.hits, c_stat.misses, c_stat.cached_frames);
+
+        const auto g_stat = GetGlyphCacheStat();
+        PrintToFD(*files_[1], "Glyph cache: %lu hits, %lu misses, %lu evictions, %lu glyphs in %lu/%lu KiB\n",
+                  g_stat.hits, g_stat.misses, g_stat.evictions, g_stat.num_glyphs,
+                  g_stat.used_bytes / 1024, g_stat.budget_bytes / 1024);
+
+        const auto v_stat = fat::VolumeCacheStat();
+        PrintToFD(*files_[1], "Volume cache: %lu hits, %lu misses, %lu read ahead, %lu written back, %lu entries in %lu/%lu KiB\n",
+                  v_stat.hits, v_stat.misses, v_stat.read_aheads, v_stat.write_backs,
+                  v_stat.num_entries, v_stat.used_bytes / 1024, v_stat.budget_bytes / 1024);
+
+        for (auto cache = slab_caches; cache; cache = cache->Next())
+        {
+            const auto s_stat = cache->Stat();
+            PrintToFD(*files_[1], "Slab %s: %lu/%lu objs of %lu bytes, %lu slabs, %lu allocs\n",
+                      cache->Name(), s_stat.objects_in_use, s_stat.objects_capacity,
+                      s_stat.object_size, s_stat.num_slabs, s_stat.num_allocations);
+        }
+    }
+    else if (strcmp(command, "pipebench") == 0)
+    {
+        // Push MiB (16 by default) through a pipe to a reader task, and measure the time to drain it
+        long mib = first_arg ? strtol(first_arg, nullptr, 0) : 0;
+        mib = mib > 0 ? std::min(mib, 1024l) : 16;
+
+        auto pipe = std::make_shared<Pipe>();
+        std::array<char, 4096> buf;
+        memset(buf.data(), 'x', buf.size());
+
+        const uint64_t start = timer_manager->Now();
+        const uint64_t reader_id = task_manager->NewTask()
+                                       .InitContext(TaskPipeReader,
+                                                    reinterpret_cast<int64_t>(pipe.get()))
+                                       .Wakeup()
+                                       .ID();
+        const uint64_t bytes = static_cast<uint64_t>(mib) * 1024 * 1024;
+        uint64_t written = 0;
+        while (written < bytes)
+        {
+            const size_t n = pipe->Write(buf.data(), std::min<uint64_t>(buf.size(), bytes - written));
+            if (n == 0)
+            {
+                break;
+            }
+            written += n;
+        }
+        pipe->CloseWrite();
+
+        __asm__("cli");
+        task_manager->WaitFinish(reader_id);
+        __asm__("sti");
+        const uint64_t elapsed_ns = std::max<uint64_t>(timer_manager->Now() - start, 1);
+        const uint64_t bytes_per_sec = written * 1000 / elapsed_ns * 1'000'000;
+
+        PrintToFD(*files_[1], "%lu bytes in %lu us: %lu bytes/s (%lu MiB/s)\n",
+                  written, elapsed_ns / 1000, bytes_per_sec, bytes_per_sec / (1024 * 1024));
+    }
+    else if (strcmp(command, "taskbench") == 0)
+    {
+        // Spawn tasks (256 by default), send 16 messages to each of them by ID, then finish them
+        long num_tasks = first_arg ? strtol(first_arg, nullptr, 0) : 0;
+        num_tasks = num_tasks > 0 ? std::min(num_tasks, 1024l) : 256;
+        const int kMessagesPerTask = 16;
+        std::vector<uint64_t> worker_ids;
+
+        const uint64_t spawn_start = ReadTSC();
+        for (long i = 0; i < num_tasks; ++i)
+        {
+            worker_ids.push_back(task_manager->NewTask()
+                                     .InitContext(TaskBenchWorker, 0)
+                                     .Wakeup()
+                                     .ID());
+        }
+        const uint64_t spawn_cycles = ReadTSC() - spawn_start;
+
+        Message msg{Message::kTimerTimeout, task_.ID()};
+        msg.arg.timer.value = 1;
+        const uint64_t send_start = ReadTSC();
+        for (int i = 0; i < kMessagesPerTask; ++i)
+        {
+            for (uint64_t id : worker_ids)
+            {
+                __asm__("cli");
+                task_manager->SendMessage(id, msg);
+                __asm__("sti");
+            }
+        }
+        const uint64_t send_cycles = ReadTSC() - send_start;
+
+        msg.arg.timer.value = 0;
+        const uint64_t finish_start = ReadTSC();
+        for (uint64_t id : worker_ids)
+        {
+            __asm__("cli");
+            task_manager->SendMessage(id, msg);
+            __asm__("sti");
+        }
+        for (uint64_t id : worker_ids)
+        {
+            __asm__("cli");
+            task_manager->WaitFinish(id);
+            __asm__("sti");
+        }
+        const uint64_t finish_cycles = ReadTSC() - finish_start;
+
+        const uint64_t num_messages = num_tasks * kMessagesPerTask;
+        PrintToFD(*files_[1], "%ld tasks: spawn %lu kcycles, %lu messages %lu kcycles (%lu cycles each), finish %lu kcycles\n",
+                  num_tasks, spawn_cycles / 1000, num_messages, send_cycles / 1000,
+                  send_cycles / num_messages, finish_cycles / 1000);
     }
     else if (command[0] != 0)
     {
@@ -726,18 +1130,32 @@ void Terminal::ExecuteLine()
         }
     }
 
-    if (pipe_fd)
+    if (pipe_writer)
     {
-        pipe_fd->FinishWrite();
+        // Each stage closes its pipes when it finishes, which ends the next stage's input
+        pipe_writer->Close();
+        for (uint64_t stage_id : stage_ids)
+        {
+            __asm__("cli");
+            auto [ec, err] = task_manager->WaitFinish(stage_id);
+            __asm__("sti");
+            if (err)
+            {
+                Log(kWarn, "failed to wait finish: %s\n", err.Name());
+            }
+            exit_code = ec;
+        }
         __asm__("cli");
-        auto [ec, err] = task_manager->WaitFinish(subtask_id);
         (*layer_task_map)[layer_id_] = task_.ID();
         __asm__("sti");
-        if (err)
+    }
+
+    if (redir_char)
+    {
+        if (auto err = fat::Sync())
         {
-            Log(kWarn, "failed to wait finish: %s\n", err.Name());
+            Log(kError, "failed to sync the volume: %s\n", err.Name());
         }
-        exit_code = ec;
     }
 
     last_exit_code_ = exit_code;
@@ -795,8 +1213,19 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry &file_entry,
                       stack_frame_address.value + stack_size - 8,
                       &task.OSStackPointer());
 
+    task.FlushFiles();
     task.Files().clear();
+    // Files the app has written reach the device once it exits
+    if (auto err = fat::Sync())
+    {
+        Log(kError, "failed to sync the volume: %s\n", err.Name());
+    }
     task.FileMaps().clear();
+    for (const auto &m : task.SurfaceMaps())
+    {
+        UnmapFrames(LinearAddress4Level{m.vaddr_begin}, (m.vaddr_end - m.vaddr_begin) / 4096);
+    }
+    task.SurfaceMaps().clear();
 
     uintptr_t addr_first = 0;
     if (auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000}))
@@ -813,45 +1242,33 @@ void Terminal::Print(char32_t c)
         return;
     }
 
-    auto newline = [this]()
-    {
-        cursor_.x = 0;
-        if (cursor_.y < kRows - 1)
-        {
-            ++cursor_.y;
-        }
-        else
-        {
-            Scroll1();
-        }
-    };
-
     if (c == U'\n')
     {
-        newline();
+        NewLine();
+        return;
     }
-    else if (IsHankaku(c))
+
+    const int width = IsHankaku(c) ? 1 : 2;
+    if (cursor_.x + width > kColumns)
     {
-        if (cursor_.x == kColumns)
-        {
-            newline();
-        }
-        WriteUnicode(*window_->Writer(), CalcCursorPos(), c, {255, 255, 255});
-        ++cursor_.x;
+        NewLine();
     }
-    else
+    SetCell(cursor_.x, c);
+    if (width == 2)
     {
-        if (cursor_.x == kColumns - 1)
-        {
-            newline();
-        }
-        WriteUnicode(*window_->Writer(), CalcCursorPos(), c, {255, 255, 255});
-        cursor_.x += 2;
+        SetCell(cursor_.x + 1, kWideTail);
     }
+    cursor_.x += width;
 }
 
 void Terminal::Print(const char *s, std::optional<size_t> len)
 {
+    if (!show_window_)
+    {
+        return;
+    }
+
+    LockPrint();
     const auto cursor_before = CalcCursorPos();
     DrawCursor(false);
 
@@ -862,35 +1279,158 @@ void Terminal::Print(const char *s, std::optional<size_t> len)
     {
         const auto [u32, bytes] = ConvertUTF8To32(&s[i]);
         Print(u32);
-        i += bytes;
+        i += bytes ? bytes : 1;
     }
 
+    const auto presented = Present();
     DrawCursor(true);
     const auto cursor_after = CalcCursorPos();
 
-    Vector2D<int> draw_pos{ToplevelWindow::kTopLeftMargin.x,
-                           cursor_before.y};
-    Vector2D<int> draw_size{window_->InnerSize().x,
-                            cursor_after.y - cursor_before.y + 16};
+    auto begin = ElementMin(cursor_before, cursor_after);
+    auto end = ElementMax(cursor_before, cursor_after) + Vector2D<int>{8, 16};
+    if (presented.size.x > 0)
+    {
+        begin = ElementMin(begin, presented.pos);
+        end = ElementMax(end, presented.pos + presented.size);
+    }
 
-    Rectangle<int> draw_area{draw_pos, draw_size};
+    Rectangle<int> draw_area{begin, end - begin};
     Message msg = MakeLayerMessage(
         task_.ID(), LayerID(), LayerOperation::DrawArea, draw_area);
-    __asm__("cli");
+    const auto rflags = DisableInterrupts();
     task_manager->SendMessage(1, msg);
-    __asm__("sti");
+    RestoreInterrupts(rflags);
+    UnlockPrint();
 }
 
-void Terminal::Redraw()
+void Terminal::LockPrint()
 {
-    Rectangle<int> draw_area{ToplevelWindow::kTopLeftMargin,
-                             window_->InnerSize()};
+    const auto rflags = DisableInterrupts();
+    const uint64_t id = task_manager->CurrentTask().ID();
+    while (print_owner_ != 0 && print_owner_ != id)
+    {
+        print_waiters_.Wait();
+    }
+    print_owner_ = id;
+    ++print_depth_;
+    RestoreInterrupts(rflags);
+}
 
-    Message msg = MakeLayerMessage(
-        task_.ID(), LayerID(), LayerOperation::DrawArea, draw_area);
-    __asm__("cli");
-    task_manager->SendMessage(1, msg);
-    __asm__("sti");
+void Terminal::UnlockPrint()
+{
+    const auto rflags = DisableInterrupts();
+    if (--print_depth_ == 0)
+    {
+        print_owner_ = 0;
+        print_waiters_.WakeupAll();
+    }
+    RestoreInterrupts(rflags);
+}
+
+void Terminal::Output(const char *s, size_t len)
+{
+    // Stages of a pipeline write to the same terminal, so the buffer is only touched with interrupts disabled
+    while (len > 0)
+    {
+        const auto rflags = DisableInterrupts();
+        if (output_len_ == 0)
+        {
+            output_since_ = timer_manager->CurrentTick();
+        }
+        if (flusher_id_ != 0 && !flush_timer_armed_)
+        {
+            timer_manager->AddTimer(
+                Timer{timer_manager->CurrentTick() + kOutputFlushTicks, 1, flusher_id_});
+            flush_timer_armed_ = true;
+        }
+        const size_t n = std::min(len, kOutputBufferBytes - output_len_);
+        memcpy(&output_buf_[output_len_], s, n);
+        output_lines_ += std::count(s, s + n, '\n');
+        output_len_ += n;
+        const bool full = output_len_ == kOutputBufferBytes;
+        RestoreInterrupts(rflags);
+
+        s += n;
+        len -= n;
+        if (full)
+        {
+            FlushOutput();
+        }
+    }
+
+    const auto rflags = DisableInterrupts();
+    const bool flush = output_lines_ >= kRows ||
+                       timer_manager->CurrentTick() - output_since_ >= kOutputFlushTicks;
+    RestoreInterrupts(rflags);
+    if (flush)
+    {
+        FlushOutput();
+    }
+}
+
+void Terminal::FlushOutput()
+{
+    std::array<char, kOutputBufferBytes> chunk;
+
+    // Holding the print lock from the dequeue keeps chunks of concurrent flushers in order
+    LockPrint();
+    const auto rflags = DisableInterrupts();
+    // An incomplete UTF-8 sequence at the end waits for the rest
+    size_t len = output_len_;
+    for (size_t i = 1; i <= 3 && i <= output_len_; ++i)
+    {
+        const int size = CountUTF8Size(output_buf_[output_len_ - i]);
+        if (size > static_cast<int>(i))
+        {
+            len = output_len_ - i;
+        }
+        if (size > 0)
+        {
+            break;
+        }
+    }
+
+    memcpy(chunk.data(), output_buf_.data(), len);
+    memmove(&output_buf_[0], &output_buf_[len], output_len_ - len);
+    output_len_ -= len;
+    output_lines_ = 0;
+    output_since_ = timer_manager->CurrentTick();
+    RestoreInterrupts(rflags);
+
+    if (len > 0)
+    {
+        Print(chunk.data(), len);
+    }
+    UnlockPrint();
+}
+
+void Terminal::FlushOutputByTimer()
+{
+    const auto rflags = DisableInterrupts();
+    flush_timer_armed_ = false;
+    RestoreInterrupts(rflags);
+    FlushOutput();
+}
+
+void Terminal::StopFlusher()
+{
+    const auto rflags = DisableInterrupts();
+    if (flusher_id_ != 0)
+    {
+        Message msg{Message::kTimerTimeout, task_.ID()};
+        msg.arg.timer.value = 0;
+        task_manager->SendMessage(flusher_id_, msg);
+        flusher_id_ = 0;
+    }
+    RestoreInterrupts(rflags);
+}
+
+void Terminal::CloseFiles()
+{
+    for (auto &file : files_)
+    {
+        file->Close();
+    }
 }
 
 Rectangle<int> Terminal::HistoryUpDown(int direction)
@@ -908,7 +1448,6 @@ Rectangle<int> Terminal::HistoryUpDown(int direction)
     const auto first_pos = CalcCursorPos();
 
     Rectangle<int> draw_area{first_pos, {8 * (kColumns - 1), 16}};
-    FillRectangle(*window_->Writer(), draw_area.pos, draw_area.size, {0, 0, 0});
 
     const char *history = "";
     if (cmd_history_index_ >= 0)
@@ -919,7 +1458,10 @@ Rectangle<int> Terminal::HistoryUpDown(int direction)
     strcpy(&linebuf_[0], history);
     linebuf_index_ = strlen(history);
 
-    WriteString(*window_->Writer(), first_pos, history, {255, 255, 255});
+    for (int x = 1; x < kColumns; ++x)
+    {
+        SetCell(x, x - 1 < linebuf_index_ ? history[x - 1] : 0);
+    }
     cursor_.x = linebuf_index_ + 1;
     return draw_area;
 }
@@ -956,6 +1498,8 @@ void TaskTerminal(uint64_t task_id, int64_t data)
     if (term_desc && term_desc->exit_after_command)
     {
         delete term_desc;
+        terminal->CloseFiles();
+        terminal->StopFlusher();
         __asm__("cli");
         task_manager->Finish(terminal->LastExitCode());
         __asm__("sti");
@@ -963,8 +1507,10 @@ void TaskTerminal(uint64_t task_id, int64_t data)
 
     auto add_blink_timer = [task_id](unsigned long t)
     {
+        __asm__("cli");
         timer_manager->AddTimer(
             Timer{t + static_cast<int>(kTimerFreq * 0.5), 1, task_id});
+        __asm__("sti");
     };
     add_blink_timer(timer_manager->CurrentTick());
 
@@ -1028,6 +1574,7 @@ void TaskTerminal(uint64_t task_id, int64_t data)
         case Message::kWindowClose:
         {
             CloseLayer(msg->arg.window_close.layer_id);
+            terminal->StopFlusher();
             __asm__("cli");
             task_manager->Finish(terminal->LastExitCode());
             break;
@@ -1046,6 +1593,7 @@ TerminalFileDescriptor::TerminalFileDescriptor(Terminal &term)
 size_t TerminalFileDescriptor::Read(void *buf, size_t len)
 {
     char *bufc = reinterpret_cast<char *>(buf);
+    term_.FlushOutput();
 
     while (true)
     {
@@ -1076,89 +1624,151 @@ size_t TerminalFileDescriptor::Read(void *buf, size_t len)
 
         bufc[0] = msg->arg.keyboard.ascii;
         term_.Print(bufc, 1);
-        term_.Redraw();
         return 1;
     }
 }
 
 size_t TerminalFileDescriptor::Write(const void *buf, size_t len)
 {
-    term_.Print(reinterpret_cast<const char *>(buf), len);
-    term_.Redraw();
+    term_.Output(reinterpret_cast<const char *>(buf), len);
     return len;
 }
 
+void TerminalFileDescriptor::Flush()
+{
+    term_.FlushOutput();
+}
+
 size_t TerminalFileDescriptor::Load(void *buf, size_t len, size_t offset)
 {
     return 0;
 }
 
-PipeDescriptor::PipeDescriptor(Task &task) : task_{task} {}
-
-size_t PipeDescriptor::Read(void *buf, size_t len)
+size_t Pipe::Read(void *buf, size_t len)
 {
-    if (len_ > 0)
+    bool flushed = false;
+    __asm__("cli");
+    while (read_pos_ == write_pos_ && !write_closed_)
     {
-        const size_t copy_bytes = std::min(len_, len);
-        memcpy(buf, data_, copy_bytes);
-        len_ -= copy_bytes;
-        memmove(data_, &data_[copy_bytes], len_);
-        return copy_bytes;
+        if (!flushed)
+        {
+            // Let the output so far appear before waiting for the writer
+            __asm__("sti");
+            task_manager->CurrentTask().FlushFiles();
+            flushed = true;
+            __asm__("cli");
+            continue;
+        }
+        readers_.Wait();
+        __asm__("cli");
     }
+    const size_t pos = read_pos_;
+    const size_t n = std::min(len, write_pos_ - read_pos_);
+    __asm__("sti");
 
-    if (closed_)
-    {
-        return 0;
-    }
+    // The writer does not touch these bytes until read_pos_ passes them
+    auto bufc = reinterpret_cast<char *>(buf);
+    const size_t offset = pos % kBufferBytes;
+    const size_t first = std::min(n, kBufferBytes - offset);
+    memcpy(bufc, &buf_[offset], first);
+    memcpy(&bufc[first], &buf_[0], n - first);
 
-    while (true)
+    __asm__("cli");
+    read_pos_ += n;
+    writers_.WakeupAll();
+    __asm__("sti");
+    return n;
+}
+
+size_t Pipe::Write(const void *buf, size_t len)
+{
+    auto bufc = reinterpret_cast<const char *>(buf);
+    size_t written = 0;
+    bool flushed = false;
+    while (written < len)
     {
         __asm__("cli");
-        auto msg = task_.ReceiveMessage();
-        if (!msg)
+        while (write_pos_ - read_pos_ == kBufferBytes && !read_closed_)
         {
-            task_.Sleep();
-            continue;
+            if (!flushed)
+            {
+                __asm__("sti");
+                task_manager->CurrentTask().FlushFiles();
+                flushed = true;
+                __asm__("cli");
+                continue;
+            }
+            writers_.Wait();
+            __asm__("cli");
         }
-        __asm__("sti");
-
-        if (msg->arg.pipe.len == 0)
+        if (read_closed_)
         {
-            closed_ = true;
-            return 0;
+            __asm__("sti");
+            break;
         }
+        const size_t pos = write_pos_;
+        const size_t n = std::min(len - written, kBufferBytes - (write_pos_ - read_pos_));
+        __asm__("sti");
 
-        const size_t copy_bytes = std::min<size_t>(msg->arg.pipe.len, len);
-        memcpy(buf, msg->arg.pipe.data, copy_bytes);
-        len_ = msg->arg.pipe.len - copy_bytes;
-        memcpy(data_, &msg->arg.pipe.data[copy_bytes], len_);
-        return copy_bytes;
-    }
-}
+        const size_t offset = pos % kBufferBytes;
+        const size_t first = std::min(n, kBufferBytes - offset);
+        memcpy(&buf_[offset], &bufc[written], first);
+        memcpy(&buf_[0], &bufc[written + first], n - first);
+        written += n;
 
-size_t PipeDescriptor::Write(const void *buf, size_t len)
-{
-    auto bufc = reinterpret_cast<const char *>(buf);
-    Message msg{Message::kPipe};
-    size_t sent_bytes = 0;
-    while (sent_bytes < len)
-    {
-        msg.arg.pipe.len =
-            std::min(len - sent_bytes, sizeof(msg.arg.pipe.data));
-        memcpy(msg.arg.pipe.data, &bufc[sent_bytes], msg.arg.pipe.len);
-        sent_bytes += msg.arg.pipe.len;
         __asm__("cli");
-        task_.SendMessage(msg);
+        write_pos_ += n;
+        readers_.WakeupAll();
         __asm__("sti");
     }
-    return len;
+    return written;
 }
 
-void PipeDescriptor::FinishWrite()
+void Pipe::CloseRead()
 {
-    Message msg{Message::kPipe};
-    msg.arg.pipe.len = 0;
     __asm__("cli");
-    task_.SendMessage(msg);
+    read_closed_ = true;
+    writers_.WakeupAll();
     __asm__("sti");
+}
+
+void Pipe::CloseWrite()
+{
+    __asm__("cli");
+    write_closed_ = true;
+    readers_.WakeupAll();
+    __asm__("sti");
+}
+
+PipeDescriptor::PipeDescriptor(std::shared_ptr<Pipe> pipe, bool write_end)
+    : pipe_{pipe}, write_end_{write_end} {}
+
+size_t PipeDescriptor::Read(void *buf, size_t len)
+{
+    if (write_end_)
+    {
+        return 0;
+    }
+    return pipe_->Read(buf, len);
+}
+
+size_t PipeDescriptor::Write(const void *buf, size_t len)
+{
+    if (!write_end_)
+    {
+        return 0;
+    }
+    return pipe_->Write(buf, len);
+}
+
+void PipeDescriptor::Close()
+{
+    if (write_end_)
+    {
+        pipe_->CloseWrite();
+    }
+    else
+    {
+        pipe_->CloseRead();
+    }
 }
\ No newline at end of file
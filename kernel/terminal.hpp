@@ -7,10 +7,12 @@
 #pragma once
 
 #include <array>
+#include <bitset>
 #include <deque>
 #include <map>
 #include <memory>
 #include <optional>
+#include <vector>
 #include "window.hpp"
 #include "task.hpp"
 #include "layer.hpp"
@@ -32,11 +34,21 @@ struct TerminalDescriptor
     std::array<std::shared_ptr<FileDescriptor>, 3> files;
 };
 
+/**
+ * @brief Terminal which runs commands and shows their output
+ *
+ * The text is kept in a ring buffer of cells, which also holds the lines scrolled out as the history.
+ * Printing only updates cells and marks rows dirty,
+ * and Present() moves the pixels once for all the lines scrolled meanwhile and draws the dirty rows.
+ * PageUp and PageDown scroll the view into the history.
+ */
 class Terminal
 {
 public:
     static const int kRows = 15, kColumns = 60;
     static const int kLineMax = 128;
+    /** @brief Number of lines kept in the ring buffer, including those on the screen */
+    static const int kScrollbackRows = 256;
 
     Terminal(Task &task, const TerminalDescriptor *term_desc);
     unsigned int LayerID() const { return layer_id_; }
@@ -44,10 +56,26 @@ public:
     Rectangle<int> InputKey(uint8_t modifier, uint8_t keycode, char ascii);
 
     void Print(const char *s, std::optional<size_t> len = std::nullopt);
+    /**
+     * @brief Buffer output to be printed later in a batch
+     *
+     * The buffer is flushed when it is full, when it has a screenful of lines,
+     * or kOutputFlushTicks after the oldest buffered byte by the flusher task of the terminal,
+     * so the output of an app which keeps the CPU appears as well.
+     * Writers flush it by FlushOutput() before they block.
+     */
+    void Output(const char *s, size_t len);
+    /** @brief Print the buffered output with one redraw */
+    void FlushOutput();
+    /** @brief Flush the output on the timer armed by Output(), called by the flusher task */
+    void FlushOutputByTimer();
 
     Task &UnderlyingTask() const { return task_; }
     int LastExitCode() const { return last_exit_code_; }
-    void Redraw();
+    /** @brief Close the standard files, called before a terminal of a pipeline stage finishes */
+    void CloseFiles();
+    /** @brief Finish the flusher task, called before the terminal finishes */
+    void StopFlusher();
 
 private:
     std::shared_ptr<ToplevelWindow> window_;
@@ -61,7 +89,32 @@ private:
 
     int linebuf_index_{0};
     std::array<char, kLineMax> linebuf_{};
-    void Scroll1();
+
+    using Line = std::array<char32_t, kColumns>;
+    /** @brief Cell following a full-width character, which covers two cells */
+    static const char32_t kWideTail = 0xffff'ffff;
+    /** @brief Lines indexed by the line number modulo kScrollbackRows, an empty cell is 0 */
+    std::vector<Line> lines_{};
+    /** @brief Line number of the top row of the screen, which increases by scrolling */
+    uint64_t top_line_{0};
+    /** @brief Number of lines the view is scrolled back from the screen */
+    int view_back_{0};
+    bool view_moved_{false};
+    /** @brief Rows of the screen whose pixels are older than their cells */
+    std::bitset<kRows> dirty_rows_{};
+    /** @brief Lines scrolled since the last Present() */
+    int pending_scroll_{0};
+    bool full_redraw_{false};
+
+    Line &LineAt(uint64_t line_number) { return lines_[line_number % kScrollbackRows]; }
+    Line &ScreenLine(int row) { return LineAt(top_line_ + row); }
+    int MaxViewBack() const;
+    void SetCell(int x, char32_t c);
+    void NewLine();
+    void ScrollView(int lines);
+    void DrawRow(int row, const Line &line);
+    /** @brief Bring the pixels up to date with the cells, return the updated area */
+    Rectangle<int> Present();
 
     void ExecuteLine();
     WithError<int> ExecuteFile(fat::DirectoryEntry &file_entry,
@@ -72,6 +125,28 @@ private:
     int cmd_history_index_{-1};
     Rectangle<int> HistoryUpDown(int direction);
 
+    static const size_t kOutputBufferBytes = 4096;
+    static const unsigned long kOutputFlushTicks = kTimerFreq / 30;
+    std::array<char, kOutputBufferBytes> output_buf_;
+    size_t output_len_{0};
+    int output_lines_{0};
+    unsigned long output_since_{0};
+    /** @brief Task which flushes the output on a timer, 0 if the terminal has no window */
+    uint64_t flusher_id_{0};
+    bool flush_timer_armed_{false};
+
+    /**
+     * @brief Task printing to the terminal, and the depth of its nested prints
+     *
+     * Stages of a pipeline and the flusher print to the same terminal as its own task,
+     * so printing, including the dequeue of the output buffer, is serialized by task.
+     */
+    uint64_t print_owner_{0};
+    int print_depth_{0};
+    WaitQueue print_waiters_{};
+    void LockPrint();
+    void UnlockPrint();
+
     bool show_window_;
     std::array<std::shared_ptr<FileDescriptor>, 3> files_;
     int last_exit_code_{0};
@@ -87,25 +162,51 @@ public:
     size_t Write(const void *buf, size_t len) override;
     size_t Size() const override { return 0; }
     size_t Load(void *buf, size_t len, size_t offset) override;
+    void Flush() override;
 
 private:
     Terminal &term_;
 };
 
+/**
+ * @brief Ring buffer which carries bytes from the writing end of a pipe to the reading end
+ *
+ * The reader sleeps while the buffer is empty and the writer sleeps while it is full,
+ * so a writer faster than its reader is held back instead of piling up data.
+ * Bytes are copied with interrupts enabled, so each end must be used by one task at a time.
+ */
+class Pipe
+{
+public:
+    static const size_t kBufferBytes = 4 * 4096;
+
+    /** @brief Read at least one byte, or return 0 after the writing end is closed and drained */
+    size_t Read(void *buf, size_t len);
+    /** @brief Write all bytes, or return fewer if the reading end is closed */
+    size_t Write(const void *buf, size_t len);
+    void CloseRead();
+    void CloseWrite();
+
+private:
+    std::array<char, kBufferBytes> buf_;
+    // Total bytes read and written, the difference is the bytes in buf_
+    size_t read_pos_{0}, write_pos_{0};
+    bool read_closed_{false}, write_closed_{false};
+    WaitQueue readers_{}, writers_{};
+};
+
+/** @brief One end of a Pipe */
 class PipeDescriptor : public FileDescriptor
 {
 public:
-    explicit PipeDescriptor(Task &task);
+    PipeDescriptor(std::shared_ptr<Pipe> pipe, bool write_end);
     size_t Read(void *buf, size_t len) override;
     size_t Write(const void *buf, size_t len) override;
     size_t Size() const override { return 0; }
     size_t Load(void *buf, size_t len, size_t offset) override { return 0; }
-
-    void FinishWrite();
+    void Close() override;
 
 private:
-    Task &task_;
-    char data_[16];
-    size_t len_{0};
-    bool closed_{false};
+    std::shared_ptr<Pipe> pipe_;
+    bool write_end_;
 };
\ No newline at end of file
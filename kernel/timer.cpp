@@ -1,6 +1,9 @@
 #include "timer.hpp"
 
+#include <algorithm>
+
 #include "acpi.hpp"
+#include "asmfunc.h"
 #include "interrupt.hpp"
 #include "task.hpp"
 
@@ -11,25 +14,45 @@ namespace
     volatile uint32_t &initial_count = *reinterpret_cast<uint32_t *>(0xfee00380);
     volatile uint32_t &current_count = *reinterpret_cast<uint32_t *>(0xfee00390);
     volatile uint32_t &divide_config = *reinterpret_cast<uint32_t *>(0xfee003e0);
+
+    const uint32_t kIA32TSCDeadline = 0x6e0;
+    const uint32_t kLVTTimerOneShot = 0b00 << 17;
+    const uint32_t kLVTTimerTSCDeadline = 0b10 << 17;
+    const unsigned long kNoTimeout = std::numeric_limits<unsigned long>::max();
+
+    uint64_t tsc_freq;
+    bool tsc_deadline_supported;
+
+    bool CPUSupportsTSCDeadline()
+    {
+        uint32_t eax = 1, ebx, ecx = 0, edx;
+        __asm__ volatile("cpuid"
+                         : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        return (ecx >> 24) & 1;
+    }
 }
 
 void InitializeLAPICTimer()
 {
-    timer_manager = new TimerManager;
-
     divide_config = 0b1011;  // divide 1:1
     lvt_timer = 0x001 << 16; // masked, one-shot
 
+    const auto tsc_start = ReadTSC();
     StartLAPICTimer();
     acpi::WaitMilliseconds(100);
     const auto elapsed = LAPICTimerElapsed();
     StopLAPICTimer();
+    const auto tsc_elapsed = ReadTSC() - tsc_start;
 
     lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    tsc_freq = tsc_elapsed * 10;
+    tsc_deadline_supported = CPUSupportsTSCDeadline();
 
-    divide_config = 0b1011;                                   // divide 1:1
-    lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer; // not-masked, periodic
-    initial_count = lapic_timer_freq / kTimerFreq;
+    // not-masked, armed by TimerManager on demand
+    lvt_timer = (tsc_deadline_supported ? kLVTTimerTSCDeadline : kLVTTimerOneShot) |
+                InterruptVector::kLAPICTimer;
+
+    timer_manager = new TimerManager{tsc_freq};
 }
 
 void StartLAPICTimer()
@@ -45,6 +68,33 @@ uint32_t LAPICTimerElapsed()
 void StopLAPICTimer()
 {
     initial_count = 0;
+    if (tsc_deadline_supported)
+    {
+        WriteMSR(kIA32TSCDeadline, 0);
+    }
+}
+
+void ArmLAPICTimer(uint64_t deadline)
+{
+    if (tsc_deadline_supported)
+    {
+        WriteMSR(kIA32TSCDeadline, deadline);
+        return;
+    }
+
+    // Wake up at least once a second so that the count does not overflow
+    const uint64_t now = ReadTSC();
+    const uint64_t delta = deadline > now ? std::min(deadline - now, tsc_freq) : 0;
+    const uint64_t count = delta * lapic_timer_freq / tsc_freq + 1;
+    initial_count = std::min<uint64_t>(count, kCountMax);
+}
+
+uint64_t ReadTSC()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc"
+                     : "=a"(lo), "=d"(hi));
+    return static_cast<uint64_t>(hi) << 32 | lo;
 }
 
 Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
@@ -52,48 +102,321 @@ Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
 {
 }
 
-TimerManager::TimerManager()
+void TimerWheel::Insert(TimerEntry *entry)
 {
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0});
+    const uint64_t kMaxDistance = (uint64_t{1} << (kSlotBits * kLevels)) - 1;
+
+    // Round up so that a timer never expires before its deadline
+    uint64_t unit = (entry->deadline >> kUnitShift) +
+                    ((entry->deadline & ((uint64_t{1} << kUnitShift) - 1)) != 0);
+    const uint64_t distance = std::min(unit > now_ ? unit - now_ : 0, kMaxDistance);
+    unit = now_ + distance;
+
+    int level = 0;
+    while (level < kLevels - 1 && (distance >> (kSlotBits * (level + 1))) != 0)
+    {
+        ++level;
+    }
+    const int slot = (unit >> (kSlotBits * level)) & (kSlots - 1);
+
+    auto &head = heads_[level][slot];
+    entry->level = level;
+    entry->slot = slot;
+    entry->prev = nullptr;
+    entry->next = head;
+    if (head)
+    {
+        head->prev = entry;
+    }
+    head = entry;
+    occupied_[level] |= uint64_t{1} << slot;
 }
 
-void TimerManager::AddTimer(const Timer &timer)
+void TimerWheel::Remove(TimerEntry *entry)
+{
+    auto &head = heads_[entry->level][entry->slot];
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        head = entry->next;
+    }
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    if (head == nullptr)
+    {
+        occupied_[entry->level] &= ~(uint64_t{1} << entry->slot);
+    }
+}
+
+uint64_t TimerWheel::NextUnit(int level) const
 {
-    timers_.push(timer);
+    if (occupied_[level] == 0)
+    {
+        return kNoEvent;
+    }
+
+    // Slots of the level are processed at the beginning of their spans
+    const int shift = kSlotBits * level;
+    const uint64_t first_span = (now_ + (uint64_t{1} << shift) - 1) >> shift;
+    const int rotation = first_span & (kSlots - 1);
+    const uint64_t rotated = rotation == 0
+                                 ? occupied_[level]
+                                 : (occupied_[level] >> rotation) |
+                                       (occupied_[level] << (kSlots - rotation));
+    return (first_span + __builtin_ctzl(rotated)) << shift;
 }
 
-bool TimerManager::Tick()
+uint64_t TimerWheel::NextEvent() const
 {
-    ++tick_;
+    uint64_t next = kNoEvent;
+    for (int level = 0; level < kLevels; ++level)
+    {
+        next = std::min(next, NextUnit(level));
+    }
+    return next == kNoEvent ? kNoEvent : next << kUnitShift;
+}
+
+TimerEntry *TimerWheel::Expire(uint64_t now)
+{
+    const uint64_t now_unit = now >> kUnitShift;
+    TimerEntry *expired = nullptr;
 
-    bool task_timer_timeout = false;
     while (true)
     {
-        const auto &t = timers_.top();
-        if (t.Timeout() > tick_)
+        uint64_t unit = kNoEvent;
+        for (int level = 0; level < kLevels; ++level)
+        {
+            unit = std::min(unit, NextUnit(level));
+        }
+        if (unit == kNoEvent || unit > now_unit)
         {
             break;
         }
+        now_ = unit;
+
+        // Cascade from the top, a timer may go down several levels at once
+        for (int level = kLevels - 1; level > 0; --level)
+        {
+            const int shift = kSlotBits * level;
+            if ((now_ & ((uint64_t{1} << shift) - 1)) != 0)
+            {
+                continue;
+            }
+
+            const int slot = (now_ >> shift) & (kSlots - 1);
+            TimerEntry *entry = heads_[level][slot];
+            heads_[level][slot] = nullptr;
+            occupied_[level] &= ~(uint64_t{1} << slot);
+            while (entry)
+            {
+                TimerEntry *next = entry->next;
+                Insert(entry);
+                entry = next;
+            }
+        }
+
+        const int slot = now_ & (kSlots - 1);
+        TimerEntry *entry = heads_[0][slot];
+        heads_[0][slot] = nullptr;
+        occupied_[0] &= ~(uint64_t{1} << slot);
+        while (entry)
+        {
+            TimerEntry *next = entry->next;
+            entry->next = expired;
+            expired = entry;
+            entry = next;
+        }
+
+        ++now_;
+    }
+
+    now_ = std::max(now_, now_unit + 1);
+    return expired;
+}
+
+TimerManager::TimerManager(uint64_t tsc_freq)
+    : tsc_freq_{tsc_freq}, tsc_base_{ReadTSC()},
+      task_timer_deadline_{kNoTimeout}, armed_deadline_{kNoTimeout}
+{
+}
+
+void TimerManager::AddTimer(const Timer &timer)
+{
+    if (timer.Value() == kTaskTimerValue)
+    {
+        task_timer_deadline_ = timer.Timeout() * kNanosecondsPerTick;
+        RearmInterrupt();
+        return;
+    }
+    SetTimer(0, timer.Timeout() * kNanosecondsPerTick, timer.Value(), timer.TaskID());
+}
 
-        if (t.Value() == kTaskTimerValue)
+WithError<uint64_t> TimerManager::SetTimer(uint64_t timer_id, uint64_t deadline,
+                                           int value, uint64_t task_id)
+{
+    TimerEntry *entry;
+    if (timer_id != 0)
+    {
+        entry = FindEntry(timer_id);
+        if (entry == nullptr || entry->task_id != task_id)
         {
-            task_timer_timeout = true;
-            timers_.pop();
-            timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue, 1});
-            continue;
+            return {0, MAKE_ERROR(Error::kNoSuchEntry)};
         }
+        wheel_.Remove(entry);
+    }
+    else if (free_entries_)
+    {
+        entry = free_entries_;
+        free_entries_ = entry->next;
+    }
+    else
+    {
+        entry = &entries_.emplace_back();
+        entry->index = entries_.size() - 1;
+        entry->generation = 0;
+    }
+
+    entry->pending = true;
+    entry->deadline = deadline;
+    entry->value = value;
+    entry->task_id = task_id;
+    wheel_.Insert(entry);
+    RearmInterrupt();
+    return {IDOf(entry), MAKE_ERROR(Error::kSuccess)};
+}
+
+Error TimerManager::CancelTimer(uint64_t timer_id, uint64_t task_id)
+{
+    TimerEntry *entry = FindEntry(timer_id);
+    if (entry == nullptr || entry->task_id != task_id)
+    {
+        return MAKE_ERROR(Error::kNoSuchEntry);
+    }
+
+    wheel_.Remove(entry);
+    ReleaseEntry(entry);
+    RearmInterrupt();
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+bool TimerManager::Tick()
+{
+    // The LAPIC timer is disarmed once it fires
+    armed_deadline_ = kNoTimeout;
+    in_tick_ = true;
+    const auto now = Now();
+
+    bool task_timer_timeout = false;
+    if (task_timer_deadline_ <= now)
+    {
+        task_timer_timeout = true;
+        task_timer_deadline_ = now + kTaskTimerPeriod * kNanosecondsPerTick;
+    }
+
+    TimerEntry *entry = wheel_.Expire(now);
+    while (entry)
+    {
+        TimerEntry *next = entry->next;
 
         Message m{Message::kTimerTimeout};
-        m.arg.timer.timeout = t.Timeout();
-        m.arg.timer.value = t.Value();
-        task_manager->SendMessage(t.TaskID(), m);
+        m.arg.timer.timeout = entry->deadline / kNanosecondsPerTick;
+        m.arg.timer.value = entry->value;
+        task_manager->SendMessage(entry->task_id, m);
 
-        timers_.pop();
+        ReleaseEntry(entry);
+        entry = next;
     }
 
+    in_tick_ = false;
+    RearmInterrupt();
     return task_timer_timeout;
 }
 
+unsigned long TimerManager::CurrentTick() const
+{
+    return Now() / kNanosecondsPerTick;
+}
+
+uint64_t TimerManager::Now() const
+{
+    // Split the division so that the multiplication does not overflow
+    const uint64_t elapsed = ReadTSC() - tsc_base_;
+    return elapsed / tsc_freq_ * 1'000'000'000 +
+           elapsed % tsc_freq_ * 1'000'000'000 / tsc_freq_;
+}
+
+void TimerManager::RearmInterrupt()
+{
+    // TaskManager::Wakeup() calls this with interrupts enabled, and a tick between the update of
+    // armed_deadline_ and the LAPIC timer would leave them disagreeing for good
+    const auto rflags = DisableInterrupts();
+    if (in_tick_)
+    {
+        // Tick() arms the timer after all expired timers are processed
+        RestoreInterrupts(rflags);
+        return;
+    }
+
+    uint64_t next = wheel_.NextEvent();
+    if (task_timer_deadline_ < next && task_manager && task_manager->NeedsPreemption())
+    {
+        next = task_timer_deadline_;
+    }
+
+    if (next != armed_deadline_)
+    {
+        armed_deadline_ = next;
+        if (next == kNoTimeout)
+        {
+            StopLAPICTimer();
+        }
+        else
+        {
+            ArmLAPICTimer(TSCOf(next));
+        }
+    }
+    RestoreInterrupts(rflags);
+}
+
+TimerEntry *TimerManager::FindEntry(uint64_t timer_id)
+{
+    const size_t index = (timer_id & 0xffffffffu) - 1;
+    if (timer_id == 0 || index >= entries_.size())
+    {
+        return nullptr;
+    }
+
+    TimerEntry *entry = &entries_[index];
+    if (!entry->pending || IDOf(entry) != timer_id)
+    {
+        return nullptr;
+    }
+    return entry;
+}
+
+uint64_t TimerManager::IDOf(const TimerEntry *entry)
+{
+    return static_cast<uint64_t>(entry->generation) << 32 | (entry->index + 1);
+}
+
+void TimerManager::ReleaseEntry(TimerEntry *entry)
+{
+    entry->pending = false;
+    ++entry->generation;
+    entry->next = free_entries_;
+    free_entries_ = entry;
+}
+
+uint64_t TimerManager::TSCOf(uint64_t ns) const
+{
+    return tsc_base_ + ns / 1'000'000'000 * tsc_freq_ +
+           ns % 1'000'000'000 * tsc_freq_ / 1'000'000'000;
+}
 TimerManager *timer_manager;
 unsigned long lapic_timer_freq;
 
@@ -106,4 +429,4 @@ extern "C" void LAPICTimerOnInterrupt(const TaskContext &ctx_stack)
     {
         task_manager->SwitchTask(ctx_stack);
     }
-}
\ No newline at end of file
+}
@@ -1,15 +1,23 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <queue>
-#include <vector>
+#include <deque>
 #include <limits>
+#include "error.hpp"
 #include "message.hpp"
 
 void InitializeLAPICTimer();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
+/**
+ * @brief Arm the LAPIC timer to interrupt once at the TSC value of deadline
+ *
+ * The TSC-deadline mode is used if the CPU supports it, otherwise the one-shot mode.
+ */
+void ArmLAPICTimer(uint64_t deadline);
+uint64_t ReadTSC();
 
 class Timer
 {
@@ -25,28 +33,125 @@ private:
     uint64_t task_id_;
 };
 
-/** @brief Compares two Timer objects for priority scheduling. The more timeout left, the lower the priority. */
-inline bool operator<(const Timer &lhs, const Timer &rhs)
+/** @brief A timer linked in a slot of TimerWheel */
+struct TimerEntry
 {
-    return lhs.Timeout() > rhs.Timeout();
-}
+    TimerEntry *prev, *next;
+    uint64_t deadline; // nanoseconds
+    int value;
+    uint64_t task_id;
+    /** @brief Index in TimerManager, it makes the lower half of timer IDs */
+    uint32_t index;
+    /** @brief Incremented whenever the entry is released, it makes the upper half of timer IDs */
+    uint32_t generation;
+    bool pending;
+    uint8_t level, slot;
+};
+
+/**
+ * @brief Hierarchical timing wheel
+ *
+ * Time is measured in units of 2^kUnitShift nanoseconds.
+ * Level L has kSlots slots, each of which spans kSlots^L units.
+ * A timer is put in the lowest level whose span covers its distance from now, and
+ * it is moved down (cascaded) when the time reaches the beginning of its slot.
+ * A bitmap per level tells which slots have timers, so time can jump over empty slots
+ * while the CPU sleeps, and the next event is found without walking the slots.
+ * Insert and Remove are O(1), Expire is O(1) per expired or cascaded timer.
+ */
+class TimerWheel
+{
+public:
+    static const int kUnitShift = 16; // about 65.5 us
+    static const int kSlotBits = 6;
+    static const int kSlots = 1 << kSlotBits;
+    static const int kLevels = 6; // covers about 52 days, later timers are cascaded again
+    static const uint64_t kNoEvent = std::numeric_limits<uint64_t>::max();
+
+    TimerWheel() = default;
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    void Insert(TimerEntry *entry);
+    void Remove(TimerEntry *entry);
+    /** @brief Nanoseconds when a slot has to be processed next, or kNoEvent */
+    uint64_t NextEvent() const;
+    /**
+     * @brief Advance the time to now and unlink the timers which expired
+     * @return the expired timers chained by TimerEntry::next
+     */
+    TimerEntry *Expire(uint64_t now);
 
+private:
+    /** @brief The first unit which has not been processed */
+    uint64_t now_{0};
+    std::array<std::array<TimerEntry *, kSlots>, kLevels> heads_{};
+    std::array<uint64_t, kLevels> occupied_{};
+
+    /** @brief The first unit from now_ when slot of the level is processed, or kNoEvent */
+    uint64_t NextUnit(int level) const;
+};
+
+/**
+ * @brief Timers driven by a one-shot LAPIC timer
+ *
+ * The clock is the TSC, counted in nanoseconds from the start of TimerManager.
+ * A tick is 1 / kTimerFreq seconds of it.
+ * There is no periodic interrupt: the LAPIC timer is armed for the next event of the wheel,
+ * or for the task timer only while another task waits for the CPU.
+ * So an idle system is not woken up until something is due.
+ *
+ * Timers are identified by IDs which embed the generation of their entries,
+ * so a timer which has expired or has been cancelled is never confused with a new one.
+ * Call the member functions except CurrentTick(), Now() and RearmInterrupt() with interrupts disabled.
+ */
 class TimerManager
 {
 public:
-    TimerManager();
+    TimerManager(uint64_t tsc_freq);
+    /** @brief Add a timer which expires at the tick timer.Timeout() */
     void AddTimer(const Timer &timer);
+    /**
+     * @brief Add a timer which expires at deadline nanoseconds
+     *
+     * If timer_id is not 0, the pending timer of the ID is rearmed instead.
+     * @return ID of the timer
+     */
+    WithError<uint64_t> SetTimer(uint64_t timer_id, uint64_t deadline, int value, uint64_t task_id);
+    /** @brief Cancel a pending timer of the task */
+    Error CancelTimer(uint64_t timer_id, uint64_t task_id);
+    /** @brief Process expired timers, return true if the task timer expired */
     bool Tick();
-    unsigned long CurrentTick() const { return tick_; }
+    unsigned long CurrentTick() const;
+    /** @brief Nanoseconds since the start of TimerManager */
+    uint64_t Now() const;
+    /** @brief Arm the LAPIC timer again, call this when the need of preemption may change */
+    void RearmInterrupt();
 
 private:
-    volatile unsigned long tick_{0};
-    std::priority_queue<Timer> timers_{};
+    const uint64_t tsc_freq_;
+    const uint64_t tsc_base_;
+    TimerWheel wheel_{};
+    /** @brief Entries are never freed to memory, since they are released in the interrupt handler */
+    std::deque<TimerEntry> entries_{};
+    TimerEntry *free_entries_{nullptr};
+    /** @brief The deadline of the task timer, which is kept apart from the wheel */
+    uint64_t task_timer_deadline_;
+    /** @brief Nanoseconds the LAPIC timer is armed for */
+    uint64_t armed_deadline_;
+    bool in_tick_{false};
+
+    TimerEntry *FindEntry(uint64_t timer_id);
+    static uint64_t IDOf(const TimerEntry *entry);
+    void ReleaseEntry(TimerEntry *entry);
+    uint64_t TSCOf(uint64_t ns) const;
 };
 
 extern TimerManager *timer_manager;
 extern unsigned long lapic_timer_freq;
-const int kTimerFreq = 100;
+/** @brief Ticks per second, the timer interrupt does not occur at this rate */
+const int kTimerFreq = 1000;
+const uint64_t kNanosecondsPerTick = 1'000'000'000 / kTimerFreq;
 
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
 const int kTaskTimerValue = std::numeric_limits<int>::max();
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include "window.hpp"
 
+#include <cstring>
+
 #include "logger.hpp"
 #include "font.hpp"
 
@@ -45,20 +47,35 @@ namespace
     };
 }
 
-Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}, height_{height}
+Window::Window(int width, int height, PixelFormat shadow_format, bool shareable)
+    : width_{width}, height_{height}
 {
-    data_.resize(height);
-    for (int y = 0; y < height; ++y)
-    {
-        data_[y].resize(width);
-    }
-
     FrameBufferConfig config{};
     config.frame_buffer = nullptr;
     config.horizontal_resolution = width;
     config.vertical_resolution = height;
     config.pixel_format = shadow_format;
 
+    if (shareable)
+    {
+        // Frames are page aligned, so mapping them exposes nothing but the pixels
+        const size_t bytes = sizeof(uint32_t) * width * height;
+        const size_t num_frames = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+        if (auto [frame, err] = memory_manager->Allocate(num_frames); err)
+        {
+            Log(kError, "failed to allocate window surface: %s at %s:%d\n",
+                err.Name(), err.File(), err.Line());
+        }
+        else
+        {
+            surface_frame_ = frame;
+            surface_frames_ = num_frames;
+            memset(frame.Frame(), 0, num_frames * kBytesPerFrame);
+            config.frame_buffer = reinterpret_cast<uint8_t *>(frame.Frame());
+            config.pixels_per_scan_line = width;
+        }
+    }
+
     if (auto err = shadow_buffer_.Initialize(config))
     {
         Log(kError, "failed to initialize shadow buffer: %s at %s:%d\n",
@@ -66,33 +83,30 @@ Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}
     }
 }
 
+Window::~Window()
+{
+    if (surface_frames_ == 0)
+    {
+        return;
+    }
+    if (auto err = memory_manager->Free(surface_frame_, surface_frames_))
+    {
+        Log(kError, "failed to free window surface: %s\n", err.Name());
+    }
+}
+
 void Window::DrawTo(FrameBuffer &dst, Vector2D<int> pos, const Rectangle<int> &area)
 {
+    Rectangle<int> window_area{pos, Size()};
+    Rectangle<int> intersection = area & window_area;
     if (!transparent_color_)
     {
-        Rectangle<int> window_area{pos, Size()};
-        Rectangle<int> intersection = area & window_area;
         dst.Copy(intersection.pos, shadow_buffer_, {intersection.pos - pos, intersection.size});
         return;
     }
 
-    const auto tc = transparent_color_.value();
-    auto &writer = dst.Writer();
-    for (int y = std::max(0, 0 - pos.y);
-         y < std::min(Height(), writer.Height() - pos.y);
-         ++y)
-    {
-        for (int x = std::max(0, 0 - pos.x);
-             x < std::min(Width(), writer.Width() - pos.x);
-             ++x)
-        {
-            const auto c = At(Vector2D<int>{x, y});
-            if (c != tc)
-            {
-                writer.Write(pos + Vector2D<int>{x, y}, c);
-            }
-        }
-    }
+    dst.Blend(intersection.pos, shadow_buffer_, {intersection.pos - pos, intersection.size},
+              transparent_color_.value());
 }
 
 void Window::SetTransparentColor(std::optional<PixelColor> c)
@@ -105,17 +119,21 @@ Window::WindowWriter *Window::Writer()
     return &writer_;
 }
 
-const PixelColor &Window::At(Vector2D<int> pos) const
+PixelColor Window::At(Vector2D<int> pos) const
 {
-    return data_[pos.y][pos.x];
+    return shadow_buffer_.Writer().Read(pos);
 }
 
 void Window::Write(Vector2D<int> pos, PixelColor c)
 {
-    data_[pos.y][pos.x] = c;
     shadow_buffer_.Writer().Write(pos, c);
 }
 
+void Window::FillSpan(Vector2D<int> pos, int len, PixelColor c)
+{
+    shadow_buffer_.Writer().FillSpan(pos, len, c);
+}
+
 int Window::Width() const
 {
     return width_;
@@ -141,8 +159,27 @@ WindowRegion Window::GetWindowRegion(Vector2D<int> pos)
     return WindowRegion::kOther;
 }
 
+ToplevelWindow::InnerAreaWriter::InnerAreaWriter(ToplevelWindow &window) : window_{window}
+{
+    auto config = window_.ShadowBuffer().Config();
+    if (config.frame_buffer == nullptr)
+    {
+        return;
+    }
+    config.frame_buffer += sizeof(uint32_t) *
+                           (config.pixels_per_scan_line * kTopLeftMargin.y + kTopLeftMargin.x);
+    config.horizontal_resolution = Width();
+    config.vertical_resolution = Height();
+    if (auto err = inner_area_.Initialize(config))
+    {
+        Log(kError, "failed to initialize the inner area of a window: %s\n", err.Name());
+        inner_area_ = FrameBuffer{};
+    }
+}
+
 ToplevelWindow::ToplevelWindow(int width, int height, PixelFormat shadow_format,
-                               const std::string &title) : Window{width, height, shadow_format}, title_{title}
+                               const std::string &title, bool shareable)
+    : Window{width, height, shadow_format, shareable}, title_{title}
 {
     DrawWindow(*Writer(), title_.c_str());
 }
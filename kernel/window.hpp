@@ -11,6 +11,8 @@
 #include <string>
 #include "graphics.hpp"
 #include "frame_buffer.hpp"
+#include "memory_manager.hpp"
+#include "slab.hpp"
 
 enum class WindowRegion
 {
@@ -39,18 +41,28 @@ public:
             window_.Write(pos, c);
         };
 
+        virtual void FillSpan(Vector2D<int> pos, int len, const PixelColor &c) override
+        {
+            window_.FillSpan(pos, len, c);
+        }
+
         /** @brief Get the pixel of width for the window */
         virtual int Width() const override { return window_.Width(); };
 
         /** @brief Get the pixel of height for the window */
         virtual int Height() const override { return window_.Height(); };
 
+        virtual FrameBufferWriter *Native() override { return &window_.shadow_buffer_.Writer(); }
+
     private:
         Window &window_;
     };
 
-    Window(int width, int height, PixelFormat shadow_format);
-    virtual ~Window() = default;
+    /**
+     * @param shareable Place the pixels in frames of their own so that they can be mapped into applications
+     */
+    Window(int width, int height, PixelFormat shadow_format, bool shareable = false);
+    virtual ~Window();
     Window(const Window &) = delete;
     Window &operator=(const Window &rhs) = delete;
 
@@ -64,14 +76,18 @@ public:
 
     /** @brief Set transparent color */
     void SetTransparentColor(std::optional<PixelColor> c);
+    /** @brief Whether the window hides everything under it */
+    bool IsOpaque() const { return !transparent_color_; }
 
     /** @brief Get the writer for the instance */
     WindowWriter *Writer();
 
     /** @brief Get the pixel at the specified position */
-    const PixelColor &At(Vector2D<int> pos) const;
+    PixelColor At(Vector2D<int> pos) const;
     /** @brief Write the pixel at the specified position */
     void Write(Vector2D<int> pos, PixelColor c);
+    /** @brief Write the color to len pixels from the specified position to the right */
+    void FillSpan(Vector2D<int> pos, int len, PixelColor c);
 
     /** @brief Get the width of the window */
     int Width() const;
@@ -92,13 +108,25 @@ public:
     virtual void Deactivate() {}
     virtual WindowRegion GetWindowRegion(Vector2D<int> pos);
 
+    /** @brief Get the first frame of the pixels, kNullFrame unless the window is shareable */
+    FrameID SurfaceFrame() const { return surface_frame_; }
+    /** @brief Get the number of frames which hold the pixels */
+    size_t SurfaceFrames() const { return surface_frames_; }
+    /** @brief Get the configuration of the pixels to tell applications the layout */
+    const FrameBufferConfig &SurfaceConfig() const { return shadow_buffer_.Config(); }
+
+protected:
+    FrameBuffer &ShadowBuffer() { return shadow_buffer_; }
+
 private:
     int width_, height_;
-    std::vector<std::vector<PixelColor>> data_{};
     WindowWriter writer_{*this};
     std::optional<PixelColor> transparent_color_{std::nullopt};
 
+    /** @brief The only store of the pixels, in the native format of the screen */
     FrameBuffer shadow_buffer_{};
+    FrameID surface_frame_{kNullFrame};
+    size_t surface_frames_{0};
 };
 
 class ToplevelWindow : public Window
@@ -112,11 +140,15 @@ public:
     class InnerAreaWriter : public PixelWriter
     {
     public:
-        InnerAreaWriter(ToplevelWindow &window) : window_{window} {}
+        InnerAreaWriter(ToplevelWindow &window);
         virtual void Write(Vector2D<int> pos, const PixelColor &c) override
         {
             window_.Write(pos + kTopLeftMargin, c);
         }
+        virtual void FillSpan(Vector2D<int> pos, int len, const PixelColor &c) override
+        {
+            window_.FillSpan(pos + kTopLeftMargin, len, c);
+        }
         virtual int Width() const override
         {
             return window_.Width() - kTopLeftMargin.x - kBottomRightMargin.x;
@@ -125,13 +157,19 @@ public:
         {
             return window_.Height() - kTopLeftMargin.y - kBottomRightMargin.y;
         }
+        virtual FrameBufferWriter *Native() override
+        {
+            return inner_area_.Config().frame_buffer ? &inner_area_.Writer() : nullptr;
+        }
 
     private:
         ToplevelWindow &window_;
+        /** @brief View of the inner area of the shadow buffer, which shares the pixels with it */
+        FrameBuffer inner_area_{};
     };
 
     ToplevelWindow(int width, int height, PixelFormat shadow_format,
-                   const std::string &title);
+                   const std::string &title, bool shareable = false);
 
     virtual void Activate() override;
     virtual void Deactivate() override;
@@ -145,6 +183,10 @@ private:
     InnerAreaWriter inner_writer_{*this};
 };
 
+inline constexpr char kToplevelWindowSlabName[] = "ToplevelWindow";
+/** @brief Allocator to create ToplevelWindow by std::allocate_shared */
+using ToplevelWindowAllocator = SlabAllocator<ToplevelWindow, kToplevelWindowSlabName>;
+
 void DrawWindow(PixelWriter &writer, const char *title);
 void DrawTextbox(PixelWriter &writer, Vector2D<int> pos, Vector2D<int> size);
 void DrawTerminal(PixelWriter &writer, Vector2D<int> pos, Vector2D<int> size);
@@ -0,0 +1,29 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /** @brief Pixels of a window mapped by SyscallOpenWindowSurface */
+    struct WindowSurface
+    {
+        /** @brief The top-left pixel of the window, the title bar and the border included */
+        uint32_t *pixels;
+        int width, height;
+        int pixels_per_scan_line;
+
+        /**
+         * @brief Layout of a pixel
+         *
+         * kRGB stores R in the lowest byte, kBGR stores B in the lowest byte.
+         */
+        enum Format
+        {
+            kRGB,
+            kBGR,
+        } format;
+    };
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,153 @@
+// Microbenchmark of BitmapMemoryManager on the host
+//
+// Build: g++ -std=c++17 -O2 -I../kernel framebench.cpp ../kernel/memory_manager.cpp -o framebench
+//
+// The manager keeps its free lists in the first frame of each free block, which it reaches
+// by the physical address of the frame. So the frames of the arena are mapped
+// at the same addresses here, and only the frames it writes to take memory.
+//
+// Fragmentation p% means that p% of the arena is pinned by the memory map before
+// SetMemoryRange(), as pieces alternating with free holes of about kHoleFrames frames.
+// For each case the runs are allocated until kMaxRuns runs or the arena is full, then freed.
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+
+extern "C" caddr_t program_break, program_break_end;
+caddr_t program_break, program_break_end;
+
+int Log(LogLevel level, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    const int result = vfprintf(stderr, format, ap);
+    va_end(ap);
+    return result;
+}
+
+Error SetupKernelPageMaps(LinearAddress4Level addr, size_t num_4kpages)
+{
+    return MAKE_ERROR(Error::kNoEnoughMemory);
+}
+
+Error CleanKernelPageMaps(LinearAddress4Level addr, size_t num_4kpages)
+{
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+namespace
+{
+    const size_t kArenaBegin = (4_GiB) / kBytesPerFrame;
+    const size_t kArenaFrames = size_t{1} << 22;
+    const size_t kHoleFrames = 65536;
+    const size_t kMaxRuns = 4096;
+    const int kRounds = 20;
+
+    using Clock = std::chrono::steady_clock;
+
+    double ElapsedNs(Clock::time_point start)
+    {
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    }
+
+    /** @brief Pin pieces of the arena so that the ratio of pinned frames is fragmentation */
+    void Fragment(BitmapMemoryManager &manager, double fragmentation, std::mt19937_64 &rng)
+    {
+        const double pin_frames = kHoleFrames * fragmentation / (1 - fragmentation);
+        std::uniform_real_distribution<double> jitter{0.5, 1.5};
+        size_t frame = kArenaBegin;
+        const size_t end = kArenaBegin + kArenaFrames;
+        while (frame < end)
+        {
+            frame += static_cast<size_t>(kHoleFrames * jitter(rng));
+            const size_t pin = std::min(static_cast<size_t>(pin_frames * jitter(rng)),
+                                        end - std::min(frame, end));
+            if (frame < end)
+            {
+                manager.MarkAllocated(FrameID{frame}, pin);
+            }
+            frame += pin;
+        }
+    }
+
+    void Run(size_t run_frames, double fragmentation)
+    {
+        auto manager = new BitmapMemoryManager;
+        manager->MarkAllocated(FrameID{0}, kArenaBegin);
+        manager->MarkAllocated(FrameID{kArenaBegin + kArenaFrames},
+                               BitmapMemoryManager::kFrameCount - kArenaBegin - kArenaFrames);
+        std::mt19937_64 rng{run_frames};
+        Fragment(*manager, fragmentation, rng);
+
+        auto start = Clock::now();
+        manager->SetMemoryRange(FrameID{kArenaBegin}, FrameID{kArenaBegin + kArenaFrames});
+        const double init_ns = ElapsedNs(start);
+        const auto stat = manager->Stat();
+
+        std::vector<FrameID> runs;
+        double alloc_ns = 0, free_ns = 0;
+        size_t num_allocs = 0;
+        for (int round = 0; round < kRounds; ++round)
+        {
+            start = Clock::now();
+            while (runs.size() < kMaxRuns)
+            {
+                auto [frame, err] = manager->Allocate(run_frames);
+                if (err)
+                {
+                    break;
+                }
+                runs.push_back(frame);
+            }
+            alloc_ns += ElapsedNs(start);
+            num_allocs += runs.size();
+
+            // Free in a shuffled order so that merges happen across the arena
+            std::shuffle(runs.begin(), runs.end(), rng);
+            start = Clock::now();
+            for (auto frame : runs)
+            {
+                manager->Free(frame, run_frames);
+            }
+            free_ns += ElapsedNs(start);
+            runs.clear();
+        }
+
+        printf("%6zu frames %3.0f%% used: init %8.0f us, %5zu runs, alloc %8.1f ns, free %8.1f ns\n",
+               run_frames, 100.0 * stat.allocated_frames / stat.total_frames, init_ns / 1000,
+               num_allocs / kRounds,
+               num_allocs ? alloc_ns / num_allocs : 0.0, num_allocs ? free_ns / num_allocs : 0.0);
+        delete manager;
+    }
+}
+
+int main()
+{
+    void *arena = mmap(FrameID{kArenaBegin}.Frame(), kArenaFrames * kBytesPerFrame,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (arena != FrameID{kArenaBegin}.Frame())
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    for (double fragmentation : {0.1, 0.5, 0.9})
+    {
+        for (size_t run_frames : {1, 16, 512, 32768})
+        {
+            Run(run_frames, fragmentation);
+        }
+    }
+    return 0;
+}
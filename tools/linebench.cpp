@@ -0,0 +1,178 @@
+// Benchmark of DrawLine against the previous WinDrawLine on the host
+//
+// Build: g++ -std=c++17 -O2 -I../kernel linebench.cpp ../kernel/graphics.cpp ../kernel/frame_buffer.cpp -o linebench
+//
+// Both draw the same random lines inside a 1024x768 frame buffer through a writer which
+// forwards to it like the writer of a window, and the speed is printed in lines per second.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "frame_buffer.hpp"
+#include "graphics.hpp"
+
+namespace
+{
+    const int kWidth = 1024, kHeight = 768;
+    const int kNumLines = 4096;
+    const double kMinSeconds = 0.5;
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Line
+    {
+        Vector2D<int> p0, p1;
+    };
+
+    /** @brief Writer which forwards to a frame buffer as Window::Writer() does to the shadow buffer */
+    class ForwardingWriter : public PixelWriter
+    {
+    public:
+        ForwardingWriter(FrameBufferWriter &target) : target_{target} {}
+        void Write(Vector2D<int> pos, const PixelColor &c) override { target_.Write(pos, c); }
+        void FillSpan(Vector2D<int> pos, int len, const PixelColor &c) override
+        {
+            target_.FillSpan(pos, len, c);
+        }
+        int Width() const override { return target_.Width(); }
+        int Height() const override { return target_.Height(); }
+        FrameBufferWriter *Native() override { return &target_; }
+
+    private:
+        FrameBufferWriter &target_;
+    };
+
+    /** @brief WinDrawLine before the integer rasterizer, which writes every pixel by Write() */
+    void DrawLineDouble(PixelWriter &writer, int x0, int y0, int x1, int y1, const PixelColor &c)
+    {
+        auto sign = [](int x)
+        {
+            return (x > 0) ? 1 : (x < 0) ? -1
+                                         : 0;
+        };
+        const int dx = x1 - x0 + sign(x1 - x0);
+        const int dy = y1 - y0 + sign(y1 - y0);
+
+        if (dx == 0 && dy == 0)
+        {
+            writer.Write({x0, y0}, c);
+            return;
+        }
+
+        const auto floord = static_cast<double (*)(double)>(floor);
+        const auto ceild = static_cast<double (*)(double)>(ceil);
+
+        if (abs(dx) >= abs(dy))
+        {
+            if (dx < 0)
+            {
+                std::swap(x0, x1);
+                std::swap(y0, y1);
+            }
+            const auto roudish = y1 >= y0 ? floord : ceild;
+            const double m = static_cast<double>(dy) / dx;
+            for (int x = x0; x <= x1; ++x)
+            {
+                const int y = roudish(m * (x - x0) + y0);
+                writer.Write({x, y}, c);
+            }
+        }
+        else
+        {
+            if (dy < 0)
+            {
+                std::swap(x0, x1);
+                std::swap(y0, y1);
+            }
+            const auto roundish = x1 >= x0 ? floord : ceild;
+            const double m = static_cast<double>(dx) / dy;
+            for (int y = y0; y <= y1; ++y)
+            {
+                const int x = roundish(m * (y - y0) + x0);
+                writer.Write({x, y}, c);
+            }
+        }
+    }
+
+    /** @brief Random lines whose ends are within max_len on each axis, clamped into the buffer */
+    std::vector<Line> RandomLines(std::mt19937 &rng, int max_len, bool axis_aligned)
+    {
+        std::uniform_int_distribution<int> x_dist{0, kWidth - 1}, y_dist{0, kHeight - 1};
+        std::uniform_int_distribution<int> d_dist{-max_len, max_len};
+        std::vector<Line> lines;
+        for (int i = 0; i < kNumLines; ++i)
+        {
+            const Vector2D<int> p0{x_dist(rng), y_dist(rng)};
+            Vector2D<int> d{d_dist(rng), d_dist(rng)};
+            if (axis_aligned)
+            {
+                (i % 2 ? d.x : d.y) = 0;
+            }
+            const Vector2D<int> p1{std::clamp(p0.x + d.x, 0, kWidth - 1),
+                                   std::clamp(p0.y + d.y, 0, kHeight - 1)};
+            lines.push_back({p0, p1});
+        }
+        return lines;
+    }
+
+    /** @brief Draw the lines repeatedly for kMinSeconds, return lines per second */
+    double Measure(const std::vector<Line> &lines, const std::function<void(const Line &)> &draw)
+    {
+        const auto start = Clock::now();
+        size_t n = 0;
+        double seconds;
+        do
+        {
+            for (const auto &line : lines)
+            {
+                draw(line);
+            }
+            n += lines.size();
+            seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        } while (seconds < kMinSeconds);
+        return n / seconds;
+    }
+}
+
+int main()
+{
+    FrameBuffer fb;
+    if (auto err = fb.Initialize({nullptr, 0, kWidth, kHeight, kPixelRGBResv8BitPerColor}))
+    {
+        fprintf(stderr, "failed to initialize a frame buffer: %s\n", err.Name());
+        return 1;
+    }
+    ForwardingWriter writer{fb.Writer()};
+    const PixelColor color{0, 0, 255};
+
+    std::mt19937 rng{1};
+    const struct
+    {
+        const char *name;
+        std::vector<Line> lines;
+    } cases[] = {
+        {"long", RandomLines(rng, kWidth, false)},
+        {"short (<= 32)", RandomLines(rng, 32, false)},
+        {"axis-aligned", RandomLines(rng, kWidth, true)},
+    };
+
+    for (const auto &c : cases)
+    {
+        const double before = Measure(c.lines, [&](const Line &l)
+                                      { DrawLineDouble(writer, l.p0.x, l.p0.y, l.p1.x, l.p1.y, color); });
+        const double after = Measure(c.lines, [&](const Line &l)
+                                     { DrawLine(writer, l.p0, l.p1, color); });
+        const double thick = Measure(c.lines, [&](const Line &l)
+                                     { DrawLine(writer, l.p0, l.p1, color, 3); });
+        const double antialiased = Measure(c.lines, [&](const Line &l)
+                                           { DrawLineAntialiased(fb.Writer(), l.p0, l.p1, color); });
+        printf("%-14s double %10.0f, integer %10.0f (%5.1fx), width 3 %10.0f, antialiased %10.0f lines/s\n",
+               c.name, before, after, after / before, thick, antialiased);
+    }
+    return 0;
+}